@@ -20,9 +20,13 @@
 #include <QDir>
 #include <QSyntaxHighlighter>
 #include <QRegularExpression>
+#include <QListWidget>
+#include <QTextCursor>
+#include <QTimer>
 #include <iostream>
 #include <regex>
 #include <unordered_set>
+#include <unordered_map>
 #include <stack>
 #include <map>
 #include <iomanip>
@@ -31,10 +35,18 @@
 #include <string>
 #include <fstream>
 #include <filesystem>
+#include <string_view>
+#include <cstdint>
 #include <memory>
 #include <sstream>
 #include <queue>
 #include <stdexcept>
+#include <cmath>
+#include <climits>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <chrono>
 #include <windows.h>
 using namespace std;
 
@@ -44,7 +56,23 @@ struct ParseNode {
     string value;
     vector<shared_ptr<ParseNode>> children;
 
+    int line = -1;  // source line, kept on NAME leaves and statements for later passes
+    uint32_t begin = 0, end = 0;  // source bytes covered, empty when not located
+
     ParseNode(string t, string v = "") : type(t), value(v) {}
+
+    // Release subtrees iteratively so very deep trees can't overflow the stack
+    ~ParseNode() {
+        vector<shared_ptr<ParseNode>> pending;
+        for (auto& child : children)
+            if (child && child.use_count() == 1) pending.push_back(move(child));
+        while (!pending.empty()) {
+            shared_ptr<ParseNode> node = move(pending.back());
+            pending.pop_back();
+            for (auto& child : node->children)
+                if (child && child.use_count() == 1) pending.push_back(move(child));
+        }
+    }
 };
 
 // Token structure
@@ -52,10 +80,169 @@ struct Token {
     string type;
     string value;
     int line;
+    int column;  // 1-based, 0 when the token source doesn't record it
+
+    // Bytes of the token in the source, when located (length 0 otherwise)
+    uint32_t offset = 0;
+    uint32_t length = 0;
+
+    Token(string t, string v, int l, int c = 0) : type(t), value(v), line(l), column(c) {}
+};
+
+// Syntax error collected while parsing
+struct Diagnostic {
+    int line;
+    int column;
+    string message;
+    uint32_t offset = 0, length = 0;  // source bytes of the offending token, when located
+};
+
+// Keywords and operators, looked up through a perfect hash on (length,
+// first char, last char) that is searched for at compile time. `type` is the
+// token type the parser sees; `flags` groups words for the GUI highlighter
+// and marks the assignment operators.
+enum class LexemeKind : unsigned char { Keyword, Operator };
+enum LexemeFlags : unsigned char { ControlFlow = 1, Constant = 2, Assignment = 4 };
+
+struct Lexeme {
+    string_view text;
+    LexemeKind kind;
+    string_view type;
+    unsigned char flags;
+};
+
+constexpr Lexeme lexemes[] = {
+    {"False", LexemeKind::Keyword, "False", Constant}, {"None", LexemeKind::Keyword, "None", Constant},
+    {"True", LexemeKind::Keyword, "True", Constant}, {"and", LexemeKind::Keyword, "and", 0},
+    {"as", LexemeKind::Keyword, "as", 0}, {"assert", LexemeKind::Keyword, "assert", 0},
+    {"async", LexemeKind::Keyword, "async", 0}, {"await", LexemeKind::Keyword, "await", 0},
+    {"break", LexemeKind::Keyword, "break", ControlFlow}, {"class", LexemeKind::Keyword, "class", 0},
+    {"continue", LexemeKind::Keyword, "continue", ControlFlow}, {"def", LexemeKind::Keyword, "def", ControlFlow},
+    {"del", LexemeKind::Keyword, "del", 0}, {"elif", LexemeKind::Keyword, "elif", ControlFlow},
+    {"else", LexemeKind::Keyword, "else", ControlFlow}, {"except", LexemeKind::Keyword, "except", 0},
+    {"finally", LexemeKind::Keyword, "finally", 0}, {"for", LexemeKind::Keyword, "for", 0},
+    {"from", LexemeKind::Keyword, "from", 0}, {"global", LexemeKind::Keyword, "global", 0},
+    {"if", LexemeKind::Keyword, "if", ControlFlow}, {"import", LexemeKind::Keyword, "import", 0},
+    {"in", LexemeKind::Keyword, "in", 0}, {"is", LexemeKind::Keyword, "is", 0},
+    {"lambda", LexemeKind::Keyword, "lambda", 0}, {"nonlocal", LexemeKind::Keyword, "nonlocal", 0},
+    {"not", LexemeKind::Keyword, "not", 0}, {"or", LexemeKind::Keyword, "or", 0},
+    {"pass", LexemeKind::Keyword, "pass", 0}, {"raise", LexemeKind::Keyword, "raise", 0},
+    {"return", LexemeKind::Keyword, "return", 0}, {"try", LexemeKind::Keyword, "try", 0},
+    {"while", LexemeKind::Keyword, "while", ControlFlow}, {"with", LexemeKind::Keyword, "with", 0},
+    {"yield", LexemeKind::Keyword, "yield", 0},
+
+    {"+", LexemeKind::Operator, "+", 0}, {"-", LexemeKind::Operator, "-", 0},
+    {"*", LexemeKind::Operator, "*", 0}, {"/", LexemeKind::Operator, "/", 0},
+    {"%", LexemeKind::Operator, "%", 0}, {"**", LexemeKind::Operator, "**", 0},
+    {"//", LexemeKind::Operator, "//", 0}, {"<<", LexemeKind::Operator, "<<", 0},
+    {">>", LexemeKind::Operator, ">>", 0}, {"&", LexemeKind::Operator, "&", 0},
+    {"|", LexemeKind::Operator, "|", 0}, {"^", LexemeKind::Operator, "^", 0},
+    {"~", LexemeKind::Operator, "~", 0}, {"@", LexemeKind::Operator, "@", 0},
+    {"<", LexemeKind::Operator, "<", 0}, {">", LexemeKind::Operator, ">", 0},
+    {"<=", LexemeKind::Operator, "<=", 0}, {">=", LexemeKind::Operator, ">=", 0},
+    {"==", LexemeKind::Operator, "==", 0}, {"!=", LexemeKind::Operator, "!=", 0},
+    {"=", LexemeKind::Operator, "=", Assignment}, {":=", LexemeKind::Operator, ":=", 0},
+    {"+=", LexemeKind::Operator, "+=", Assignment}, {"-=", LexemeKind::Operator, "-=", Assignment},
+    {"*=", LexemeKind::Operator, "*=", Assignment}, {"/=", LexemeKind::Operator, "/=", Assignment},
+    {"%=", LexemeKind::Operator, "%=", Assignment}, {"@=", LexemeKind::Operator, "@=", Assignment},
+    {"&=", LexemeKind::Operator, "&=", Assignment}, {"|=", LexemeKind::Operator, "|=", Assignment},
+    {"^=", LexemeKind::Operator, "^=", Assignment}, {"//=", LexemeKind::Operator, "//=", Assignment},
+    {"**=", LexemeKind::Operator, "**=", Assignment}, {">>=", LexemeKind::Operator, ">>=", Assignment},
+    {"<<=", LexemeKind::Operator, "<<=", Assignment}, {"->", LexemeKind::Operator, "->", 0},
+    {"(", LexemeKind::Operator, "(", 0}, {")", LexemeKind::Operator, ")", 0},
+    {"[", LexemeKind::Operator, "[", 0}, {"]", LexemeKind::Operator, "]", 0},
+    {"{", LexemeKind::Operator, "{", 0}, {"}", LexemeKind::Operator, "}", 0},
+    {",", LexemeKind::Operator, ",", 0}, {":", LexemeKind::Operator, ":", 0},
+    {".", LexemeKind::Operator, ".", 0}, {";", LexemeKind::Operator, ";", 0},
+    {"greater", LexemeKind::Operator, ">", 0},  // legacy spelling of '>' in token files
+};
+
+constexpr size_t lexemeCount = sizeof(lexemes) / sizeof(lexemes[0]);
+constexpr size_t lexemeSlotBits = 9;
+constexpr size_t lexemeSlotCount = size_t(1) << lexemeSlotBits;
+static_assert(lexemeCount < 128, "lexeme indices must fit in a signed char");
+
+// Multiplicative hash of the packed (length, first, last) key
+constexpr size_t lexemeSlot(string_view text, uint32_t seed) {
+    uint32_t key = uint32_t(text.size()) << 16 | uint32_t((unsigned char)text.front()) << 8 |
+                   uint32_t((unsigned char)text.back());
+    return uint32_t(key * seed) >> (32 - lexemeSlotBits);
+}
+
+// First seed in a golden-ratio sequence that gives every lexeme its own slot
+constexpr uint32_t findLexemeSeed() {
+    for (uint32_t i = 1; i < 100000; ++i) {
+        uint32_t seed = (i * 0x9E3779B1u) | 1u;
+        bool used[lexemeSlotCount] = {};
+        bool perfect = true;
+        for (size_t j = 0; j < lexemeCount && perfect; ++j) {
+            size_t slot = lexemeSlot(lexemes[j].text, seed);
+            perfect = !used[slot];
+            used[slot] = true;
+        }
+        if (perfect) return seed;
+    }
+    return 0;
+}
+
+constexpr uint32_t lexemeSeed = findLexemeSeed();
+static_assert(lexemeSeed != 0, "no collision-free seed for the lexeme table");
 
-    Token(string t, string v, int l) : type(t), value(v), line(l) {}
+struct LexemeSlots {
+    signed char index[lexemeSlotCount];
 };
 
+constexpr LexemeSlots buildLexemeSlots() {
+    LexemeSlots slots{};
+    for (size_t i = 0; i < lexemeSlotCount; ++i) slots.index[i] = -1;
+    for (size_t i = 0; i < lexemeCount; ++i) slots.index[lexemeSlot(lexemes[i].text, lexemeSeed)] = (signed char)i;
+    return slots;
+}
+
+constexpr LexemeSlots lexemeSlots = buildLexemeSlots();
+
+// One hash, one probe and one compare; nullptr for anything not in the table
+constexpr const Lexeme* findLexeme(string_view text) {
+    if (text.empty()) return nullptr;
+    int index = lexemeSlots.index[lexemeSlot(text, lexemeSeed)];
+    return index >= 0 && lexemes[index].text == text ? &lexemes[index] : nullptr;
+}
+
+constexpr bool isKeyword(string_view text) {
+    const Lexeme* lexeme = findLexeme(text);
+    return lexeme && lexeme->kind == LexemeKind::Keyword;
+}
+
+constexpr bool everyLexemeResolves() {
+    for (const Lexeme& lexeme : lexemes)
+        if (findLexeme(lexeme.text) != &lexeme) return false;
+    return true;
+}
+
+static_assert(everyLexemeResolves(), "every lexeme must hash to its own entry");
+constexpr bool isAssignOperator(string_view text) {
+    const Lexeme* lexeme = findLexeme(text);
+    return lexeme && lexeme->kind == LexemeKind::Operator && (lexeme->flags & Assignment);
+}
+
+// Length of the longest operator at the start of text (maximal munch); 1 for
+// a character that starts no operator, 0 for empty text
+constexpr size_t longestOperator(string_view text) {
+    for (size_t length = min<size_t>(text.size(), 3); length > 1; --length) {
+        const Lexeme* lexeme = findLexeme(text.substr(0, length));
+        if (lexeme && lexeme->kind == LexemeKind::Operator) return length;
+    }
+    return text.empty() ? 0 : 1;
+}
+
+static_assert(isKeyword("class") && isKeyword("elif") && isKeyword("None"), "keywords must resolve");
+static_assert(!isKeyword("print") && !isKeyword("classy") && !isKeyword(""), "non-keywords must miss");
+static_assert(findLexeme("//=") && findLexeme("//=")->kind == LexemeKind::Operator, "operators must resolve");
+static_assert(findLexeme("greater")->type == ">" && !findLexeme("=>"), "operator aliases must resolve");
+static_assert(longestOperator("**=2") == 3 && longestOperator(">=3") == 2 && longestOperator("=-1") == 1,
+              "operators must be matched longest first");
+static_assert(isAssignOperator("//=") && isAssignOperator("=") && !isAssignOperator("=="), "assignments must be flagged");
+
 class PythonSyntaxHighlighter : public QSyntaxHighlighter {
     Q_OBJECT
 public:
@@ -122,9 +309,9 @@ private:
 
         // Other keywords (excluding 'def' and 'class')
         QStringList keywordPatterns;
-        for (const auto& kw : keywords) {
-            if (kw != "def" && kw != "class") {
-                keywordPatterns << QString("\\b%1\\b").arg(QString::fromStdString(kw));
+        for (const Lexeme& lexeme : lexemes) {
+            if (lexeme.kind == LexemeKind::Keyword && lexeme.text != "def" && lexeme.text != "class") {
+                keywordPatterns << QString("\\b%1\\b").arg(QString::fromLatin1(lexeme.text.data(), int(lexeme.text.size())));
             }
         }
         for (const QString &pattern : keywordPatterns) {
@@ -223,15 +410,18 @@ protected:
                 QString nextChar = (start + length < text.length()) ? text.mid(start + length, 1) : "";
                 QString nextWord = (wordIndex + 1 < words.size()) ? words[wordIndex + 1] : "";
 
+                string wordText = word.toStdString();
+                const Lexeme* lexeme = findLexeme(wordText);
+                unsigned char flags = lexeme ? lexeme->flags : 0;
+
                 // Color specific control flow keywords in magenta
-                if (word == "def" || word == "if" || word == "elif" || word == "else" ||
-                    word == "while" || word == "break" || word == "continue") {
+                if (flags & ControlFlow) {
                     QTextCharFormat keywordFormat;
                     keywordFormat.setForeground(defColor);
                     setFormat(start, length, keywordFormat);
                 }
                 // Color boolean literals in dark blue
-                else if (word == "True" || word == "False" || word == "None") {
+                else if (flags & Constant) {
                     QTextCharFormat boolFormat;
                     boolFormat.setForeground(boolColor);
                     setFormat(start, length, boolFormat);
@@ -292,27 +482,160 @@ private:
     QVector<HighlightingRule> highlightingRules;
     Theme currentTheme;
 
-    static const unordered_set<string> keywords;
     static const unordered_set<string> builtins;
 };
 
-const unordered_set<string> PythonSyntaxHighlighter::keywords = {
-    "False", "await", "else", "import", "pass", "None", "break", "except",
-    "in", "raise", "True", "class", "finally", "is", "return", "and", "continue",
-    "for", "lambda", "try", "as", "def", "from", "nonlocal", "while", "assert",
-    "del", "global", "not", "with", "async", "elif", "if", "or", "yield"
-};
-
 const unordered_set<string> PythonSyntaxHighlighter::builtins = {
     "print", "len", "range", "int", "str", "float", "bool", "list", "dict", "set",
     "tuple", "abs", "max", "min", "sum", "open", "input", "type", "dir", "help"
 };
 
+// Start offset of every line of a source, for turning the 32-bit byte
+// offsets on tokens and nodes into lines and columns by binary search
+class LineIndex {
+public:
+    LineIndex() = default;
+
+    explicit LineIndex(string_view text) {
+        if (text.size() > UINT32_MAX) throw runtime_error("Source larger than 4 GiB");
+        starts.push_back(0);
+        for (size_t i = 0; i < text.size(); ++i)
+            if (text[i] == '\n') starts.push_back(uint32_t(i + 1));
+    }
+
+    size_t lineCount() const { return starts.size(); }
+
+    // Offset where a 1-based line starts
+    uint32_t lineStart(int line) const {
+        return starts.empty() ? 0 : starts[size_t(min(max(line, 1), int(starts.size()))) - 1];
+    }
+
+    // 1-based line and byte column of an offset
+    pair<int, int> position(uint32_t offset) const {
+        if (starts.empty()) return {1, int(offset) + 1};
+        size_t line = size_t(upper_bound(starts.begin(), starts.end(), offset) - starts.begin());
+        return {int(line), int(offset - starts[line - 1]) + 1};
+    }
+
+private:
+    vector<uint32_t> starts;
+};
+
+// Where the bytes of a flattened line came from: each piece maps a column
+// of the line, and the columns after it, to a byte offset in the source
+struct SourceMap {
+    vector<pair<uint32_t, uint32_t>> pieces;  // (column, source offset), by column
+
+    uint32_t sourceOffset(uint32_t column) const {
+        auto it = upper_bound(pieces.begin(), pieces.end(), make_pair(column, UINT32_MAX));
+        if (it == pieces.begin()) return column;
+        --it;
+        return it->second + (column - it->first);
+    }
+};
+
+// Find each token of `tokens` in the flattened `lines` they were lexed
+// from, filling in its column and length, and its source offset through
+// `maps` (one per line). Tokens are searched for left to right from the end
+// of the previous one on the same line; a STRING is found by its quotes,
+// INDENT and DEDENT cover the indentation, NEWLINE sits at the end of the
+// line, and an error token, whose value is a message, gets length 0 where
+// the search stands.
+void locateTokens(vector<Token>& tokens, const vector<string>& lines, const vector<SourceMap>& maps) {
+    int currentLine = 0;
+    size_t cursor = 0;
+    for (Token& token : tokens) {
+        if (token.line < 1 || size_t(token.line) > lines.size() || size_t(token.line) > maps.size()) continue;
+        const string& text = lines[size_t(token.line) - 1];
+        const SourceMap& map = maps[size_t(token.line) - 1];
+        if (token.line != currentLine) {
+            currentLine = token.line;
+            cursor = 0;
+        }
+        size_t start = cursor, length = 0;
+        if (token.type == "INDENT" || token.type == "DEDENT") {
+            length = text.find_first_not_of(" \t");
+            if (length == string::npos) length = text.size();
+            if (token.type == "DEDENT") start = length, length = 0;
+        } else if (token.type == "NEWLINE") {
+            start = text.size();
+        } else if (token.type == "STRING") {
+            // The value is requoted, so match the literal by its own quotes
+            start = text.find_first_of("'\"", cursor);
+            size_t close = start == string::npos ? start : text.find(text[start], start + 1);
+            while (close != string::npos && text[close - 1] == '\\') close = text.find(text[start], close + 1);
+            if (start == string::npos || close == string::npos) {
+                start = cursor;
+            } else {
+                while (start > cursor && isalpha((unsigned char)text[start - 1])) --start;  // r"", b"", f""
+                length = close + 1 - start;
+            }
+        } else if (token.type != "error") {
+            const Lexeme* op = findLexeme(token.value);
+            string spelling(op && op->kind == LexemeKind::Operator ? op->type : token.value);
+            start = text.find_first_not_of(" \t\f", cursor);
+            if (start == string::npos || text.compare(start, spelling.size(), spelling) != 0) start = text.find(spelling, cursor);
+            if (start == string::npos) {
+                start = cursor;
+            } else {
+                length = spelling.size();
+            }
+        }
+        cursor = max(cursor, start + length);
+        token.column = int(start) + 1;
+        token.offset = map.sourceOffset(uint32_t(start));
+        // A collapsed triple quote makes the token longer in the source
+        token.length = length ? map.sourceOffset(uint32_t(start + length)) - token.offset : 0;
+    }
+}
+
+// Binary operators by binding power (higher binds tighter). Arithmetic and
+// bitwise operators are drawn as [left, op, right] under an arithm-op node,
+// the rest as an operator node with two children.
+struct OperatorInfo {
+    string_view symbol;
+    int precedence;
+    bool rightAssoc;
+    bool arithmetic;
+};
+
+constexpr int notPrecedence = 3;     // prefix 'not'
+constexpr int unaryPrecedence = 11;  // prefix + - ~
+
+constexpr OperatorInfo binaryOperators[] = {
+    {"or", 1, false, false},
+    {"and", 2, false, false},
+    {"<", 4, false, false}, {">", 4, false, false}, {"==", 4, false, false},
+    {">=", 4, false, false}, {"<=", 4, false, false}, {"!=", 4, false, false},
+    {"in", 4, false, false}, {"not in", 4, false, false},
+    {"is", 4, false, false}, {"is not", 4, false, false},
+    {"|", 5, false, true},
+    {"^", 6, false, true},
+    {"&", 7, false, true},
+    {"<<", 8, false, true}, {">>", 8, false, true},
+    {"+", 9, false, true}, {"-", 9, false, true},
+    {"*", 10, false, true}, {"/", 10, false, true}, {"//", 10, false, true}, {"%", 10, false, true},
+    {"**", 12, true, true},
+};
+
+constexpr const OperatorInfo* findBinaryOperator(string_view symbol) {
+    for (const OperatorInfo& op : binaryOperators)
+        if (op.symbol == symbol) return &op;
+    return nullptr;
+}
+
+static_assert(findBinaryOperator("and")->precedence < notPrecedence &&
+              notPrecedence < findBinaryOperator("==")->precedence, "'not' sits between and/comparisons");
+static_assert(findBinaryOperator("*")->precedence < unaryPrecedence &&
+              unaryPrecedence < findBinaryOperator("**")->precedence, "-x**y means -(x**y)");
+
 class Parser {
 private:
     vector<Token> tokens;
     size_t current = 0;
     int nodeCounter = 0;
+    vector<Diagnostic> diagnostics;
+    unordered_set<int> lexicalErrorLines;  // already reported by the lexer
 
     // Helper function to check if we've reached the end
     bool isAtEnd() {
@@ -367,32 +690,197 @@ private:
         return make_shared<ParseNode>(expectedToken);  // create a node for the token
     }
 
+    // Leaf for token, covering its bytes in the source
+    static shared_ptr<ParseNode> tokenNode(const Token& token, const string& type, const string& value = "") {
+        auto node = make_shared<ParseNode>(type, value);
+        node->begin = token.offset;
+        node->end = token.offset + token.length;
+        return node;
+    }
+
+    // NAME leaf that remembers where it came from
+    static shared_ptr<ParseNode> nameNode(const Token& token) {
+        auto node = tokenNode(token, "NAME", token.value);
+        node->line = token.line;
+        return node;
+    }
+
+    // Give every node without a range of its own the span of its located
+    // children, bottom-up with an explicit stack
+    static void spanTree(const shared_ptr<ParseNode>& root) {
+        vector<pair<ParseNode*, size_t>> pending;
+        if (root) pending.push_back({root.get(), 0});
+        while (!pending.empty()) {
+            auto& [node, next] = pending.back();
+            if (next < node->children.size()) {
+                ParseNode* child = node->children[next++].get();
+                if (child) pending.push_back({child, 0});
+                continue;
+            }
+            for (const auto& child : node->children) {
+                if (!child || child->begin == child->end) continue;
+                if (node->begin == node->end) {
+                    node->begin = child->begin;
+                    node->end = child->end;
+                } else {
+                    node->begin = min(node->begin, child->begin);
+                    node->end = max(node->end, child->end);
+                }
+            }
+            pending.pop_back();
+        }
+    }
+
     // Parse a file input
     shared_ptr<ParseNode> program() {
+        return finishProgram(stmt_list());
+    }
+
+    // The program node around a finished statement list
+    shared_ptr<ParseNode> finishProgram(shared_ptr<ParseNode> list) {
         auto node = make_shared<ParseNode>("program");
-        node->children.push_back(stmt_list());
+        node->children.push_back(move(list));
         if (!isAtEnd()) {
             Token t = consume("ENDMARKER", "Expected ENDMARKER");
-            node->children.push_back(make_shared<ParseNode>("ENDMARKER", t.value));
+            node->children.push_back(tokenNode(t, "ENDMARKER", t.value));
         }
         return node;
     }
 
-    // Parse a statement list
+    // An indented block whose statements are still being parsed
+    struct OpenBlock {
+        shared_ptr<ParseNode> suite;        // node receiving the block's statements
+        shared_ptr<ParseNode> conditional;  // set while elif/else may still follow
+        shared_ptr<ParseNode> ifChain;
+    };
+
+    // Parse a statement list. Nested blocks are kept on an explicit stack
+    // rather than recursing through suite(), so depth is limited only by heap.
+    // A statement that fails to parse leaves an error node and parsing resumes
+    // at the next statement boundary.
     shared_ptr<ParseNode> stmt_list() {
-        auto node = make_shared<ParseNode>("stmt_list");
-        while (!isAtEnd() && !check("ENDMARKER")) {
-            if (check("NEWLINE")) { advance(); continue; }
-            node->children.push_back(stmt());
-            if (check("NEWLINE")) advance();
+        StatementList list;
+        while (stmtStep(list)) {}
+        return list.node;
+    }
+
+    // A statement list being parsed: the statements so far and the blocks
+    // still open, kept between steps so parseFor can stop after any of them
+    struct StatementList {
+        shared_ptr<ParseNode> node = make_shared<ParseNode>("stmt_list");
+        vector<OpenBlock> blocks;
+    };
+    StatementList partial;  // the one parseFor is working through
+
+    // One step of stmt_list: a statement, a blank line or the end of a
+    // block. False once the list is finished.
+    bool stmtStep(StatementList& list) {
+        const shared_ptr<ParseNode>& node = list.node;
+        vector<OpenBlock>& blocks = list.blocks;
+        size_t start = current;
+        try {
+            if (blocks.empty()) {
+                if (isAtEnd() || check("ENDMARKER")) return false;
+                if (check("NEWLINE")) { advance(); return true; }
+                stmt(node, blocks);
+            } else if (check("DEDENT") || isAtEnd()) {
+                if (check("DEDENT")) advance();
+                OpenBlock closed = blocks.back();
+                blocks.pop_back();
+                continueBlock(closed, blocks);
+            } else {
+                stmt(blocks.back().suite, blocks);
+                return true;
+            }
+            if (blocks.empty() && check("NEWLINE")) advance();
+        } catch (const runtime_error& e) {
+            recover(e.what(), blocks.empty() ? node : blocks.back().suite, start, blocks);
+        }
+        return true;
+    }
+
+    // Record a syntax error, once per line and not on lines the lexer already flagged
+    void reportError(const string& message) {
+        if (tokens.empty()) return;
+        // A statement that ran off the end of its line is reported on that line
+        Token at = isAtEnd() ? tokens.back() : tokens[current];
+        if (current > 0 && (isAtEnd() || tokens[current-1].line != at.line)) at = tokens[current-1];
+        if (lexicalErrorLines.count(at.line)) return;
+        if (!diagnostics.empty() && diagnostics.back().line == at.line) return;
+        diagnostics.push_back({at.line, at.column, message, at.offset, at.length});
+    }
+
+    // Panic-mode recovery: leave an error node in the tree and skip the rest
+    // of the broken statement. An indented body following a broken header is
+    // still parsed, under the error node.
+    void recover(const string& message, const shared_ptr<ParseNode>& parent, size_t start, vector<OpenBlock>& blocks) {
+        reportError(message);
+        auto errorNode = make_shared<ParseNode>("error", message);
+        parent->children.push_back(errorNode);
+
+        synchronize(start);
+        spanFrom(start, errorNode);
+        if (check("INDENT")) {
+            advance();
+            OpenBlock orphan{make_shared<ParseNode>("suite"), nullptr, nullptr};
+            errorNode->children.push_back(orphan.suite);
+            blocks.push_back(orphan);
+        }
+    }
+
+    // Skip to the next NEWLINE, ';', INDENT/DEDENT or first token of a later line
+    void synchronize(size_t start) {
+        if (current == start && !isAtEnd()) {
+            // Always make progress; a stray INDENT/DEDENT is the whole problem
+            if (check("INDENT")) return;
+            if (advance().type == "DEDENT") return;
+        }
+        if (current == 0) return;
+        int line = tokens[current-1].line;
+        while (!isAtEnd()) {
+            if (check("NEWLINE") || check(";")) { advance(); return; }
+            if (check("INDENT") || check("DEDENT")) return;
+            if (tokens[current].line != line) return;
+            advance();
         }
-        return node;
     }
 
-    // Parse a statement
-    shared_ptr<ParseNode> stmt() {
-        if (isSimpleStmt()) return simple_stmts();
-        return block_stmt();
+    // Parse a statement into parent; a block statement leaves its body open
+    // on blocks. The statement's node remembers the line it starts on.
+    void stmt(const shared_ptr<ParseNode>& parent, vector<OpenBlock>& blocks) {
+        if (isSimpleStmt()) {
+            size_t start = current;
+            parent->children.push_back(simple_stmts());
+            spanFrom(start, parent->children.back());
+            return;
+        }
+        // parent may live in blocks, which block_stmt can grow
+        shared_ptr<ParseNode> target = parent;
+        size_t start = current, added = target->children.size();
+        block_stmt(target, blocks);
+        // Just the header; spanTree widens it over the suite
+        for (size_t i = added; i < target->children.size(); ++i) spanFrom(start, target->children[i]);
+    }
+
+    // Widen node to cover the tokens from start up to the current one,
+    // leaving out the line break and indentation that end a header, and
+    // note the line it starts on
+    void spanFrom(size_t start, const shared_ptr<ParseNode>& node) {
+        if (node->line < 0 && start < tokens.size()) node->line = tokens[start].line;
+        size_t last = current;
+        while (last > start && (tokens[last-1].type == "NEWLINE" || tokens[last-1].type == "INDENT" ||
+                                tokens[last-1].type == "DEDENT"))
+            --last;
+        if (last == start) return;
+        uint32_t begin = tokens[start].offset, end = tokens[last-1].offset + tokens[last-1].length;
+        if (begin == end) return;
+        if (node->begin == node->end) {
+            node->begin = begin;
+            node->end = end;
+        } else {
+            node->begin = min(node->begin, begin);
+            node->end = max(node->end, end);
+        }
     }
 
     // Check for simple statement
@@ -404,24 +892,21 @@ private:
     // Parse simple statements
     shared_ptr<ParseNode> simple_stmts() {
         auto node = make_shared<ParseNode>("simple_stmts");
+        size_t start = current;
         node->children.push_back(small_stmt());
+        spanFrom(start, node->children.back());
         while (match({";"})) {
             if (check("NEWLINE") || isAtEnd()) break;
+            start = current;
             node->children.push_back(small_stmt());
+            spanFrom(start, node->children.back());
         }
         return node;
     }
 
     // Parse a small statement
     shared_ptr<ParseNode> small_stmt() {
-        if (check("NAME") && current + 1 < tokens.size() &&
-            (tokens[current+1].type == "=" ||
-             tokens[current+1].type == "+=" ||
-             tokens[current+1].type == "-=" ||
-             tokens[current+1].type == "*=" ||
-             tokens[current+1].type == "/=" ||
-             tokens[current+1].type == "%=" ||
-             tokens[current+1].type == "//="))
+        if (check("NAME") && current + 1 < tokens.size() && isAssignOperator(tokens[current+1].type))
             return assignment();
 
         if (check("pass") || check("break") || check("continue") || check("return"))
@@ -462,21 +947,22 @@ private:
         if (tokens[current-1].type == "import") {
             node->children.push_back(module_ref());
             if (match({"as"})) {
-                node->children.push_back(make_shared<ParseNode>("NAME", consume("NAME", "Expected NAME after 'as'").value));
+                node->children.push_back(nameNode(consume("NAME", "Expected NAME after 'as'")));
             }
             while (match({","})) {
                 node->children.push_back(module_ref());
                 if (match({"as"})) {
-                    node->children.push_back(make_shared<ParseNode>("NAME", consume("NAME", "Expected NAME after 'as'").value));
+                    node->children.push_back(nameNode(consume("NAME", "Expected NAME after 'as'")));
                 }
             }
         } else if (tokens[current-1].type == "from") {
+            node->value = "from";
             node->children.push_back(module_ref());
             consume("import", "Expected 'import'");
             if (check("NAME")) {
-                node->children.push_back(make_shared<ParseNode>("NAME", advance().value));
+                node->children.push_back(nameNode(advance()));
                 if (match({"as"})) {
-                    node->children.push_back(make_shared<ParseNode>("NAME", consume("NAME", "Expected NAME after 'as'").value));
+                    node->children.push_back(nameNode(consume("NAME", "Expected NAME after 'as'")));
                 }
             } else if (match({"*"})) {
                 node->children.push_back(make_shared<ParseNode>("*"));
@@ -488,9 +974,9 @@ private:
     // Parse a module reference
     shared_ptr<ParseNode> module_ref() {
         auto node = make_shared<ParseNode>("module_ref");
-        node->children.push_back(make_shared<ParseNode>("NAME", consume("NAME", "Expected module name").value));
+        node->children.push_back(nameNode(consume("NAME", "Expected module name")));
         while (match({"."})) {
-            node->children.push_back(make_shared<ParseNode>("NAME", consume("NAME", "Expected name after '.'").value));
+            node->children.push_back(nameNode(consume("NAME", "Expected name after '.'")));
         }
         return node;
     }
@@ -507,17 +993,17 @@ private:
     // Parse targets
     shared_ptr<ParseNode> targets() {
         auto node = make_shared<ParseNode>("targets");
-        node->children.push_back(make_shared<ParseNode>("NAME", consume("NAME", "Expected target name").value));
+        node->children.push_back(nameNode(consume("NAME", "Expected target name")));
         while (match({","})) {
-            node->children.push_back(make_shared<ParseNode>("NAME", consume("NAME", "Expected name after ','").value));
+            node->children.push_back(nameNode(consume("NAME", "Expected name after ','")));
         }
         return node;
     }
 
     // Parse an assignment operator
     shared_ptr<ParseNode> assign_op() {
-        if (match({"=", "+=", "-=", "*=", "/=", "%=", "//="})) {
-            return make_shared<ParseNode>("assign_op", tokens[current-1].type);
+        if (!isAtEnd() && isAssignOperator(peek().type)) {
+            return make_shared<ParseNode>("assign_op", advance().type);
         }
         throw runtime_error("Expected assignment operator");
     }
@@ -527,8 +1013,8 @@ private:
         auto node = make_shared<ParseNode>("exprs");
         auto expr_node = expr();
         // Flatten the expression tree into exprs children
-        if (expr_node->value.empty() && !expr_node->children.empty()) {
-            // Operator expression (like a / b)
+        if (expr_node->type.empty() && !expr_node->children.empty()) {
+            // Arithmetic expression (like a / b); other operators keep their node
             for (auto& child : expr_node->children) {
                 node->children.push_back(child);
             }
@@ -554,7 +1040,7 @@ private:
     // Parse a callable
     shared_ptr<ParseNode> callable() {
         if (check("NAME")) {
-            return make_shared<ParseNode>("NAME", advance().value);
+            return nameNode(advance());
         }
         return module_ref();
     }
@@ -571,39 +1057,44 @@ private:
     }
 
     // Parse a block statement
-    shared_ptr<ParseNode> block_stmt() {
-        if (check("if")) return conditional();
-        if (check("while")) return loop();
-        if (check("for")) return loop();
-        if (check("def")) return definition();
-        if (check("class")) return definition();
+    void block_stmt(const shared_ptr<ParseNode>& parent, vector<OpenBlock>& blocks) {
+        if (check("if")) return conditional(parent, blocks);
+        if (check("while")) return loop(parent, blocks);
+        if (check("for")) return loop(parent, blocks);
+        if (check("def")) return definition(parent, blocks);
+        if (check("class")) return definition(parent, blocks);
         throw runtime_error("Unknown block statement type: " + peek().type);
     }
 
     // Parse a conditional statement
-    shared_ptr<ParseNode> conditional() {
+    void conditional(const shared_ptr<ParseNode>& parent, vector<OpenBlock>& blocks) {
         auto node = make_shared<ParseNode>("conditional");
-        node->children.push_back(if_chain());
-        if (match({"else"})) {
-            consume(":", "Expected ':' after else");
-            node->children.push_back(suite());
-        }
-        return node;
-    }
-
-    // Parse an if chain
-    shared_ptr<ParseNode> if_chain() {
-        auto node = make_shared<ParseNode>("if_chain");
+        auto chain = make_shared<ParseNode>("if_chain");
+        parent->children.push_back(node);
+        node->children.push_back(chain);
         consume("if", "Expected 'if'");
-        node->children.push_back(comparison_expr());
+        chain->children.push_back(comparison_expr());
         consume(":", "Expected ':' after condition");
-        node->children.push_back(suite());
-        while (match({"elif"})) {
-            node->children.push_back(comparison_expr());
-            consume(":", "Expected ':' after elif condition");
-            node->children.push_back(suite());
+        OpenBlock resume{nullptr, node, chain};
+        if (!suite(chain, blocks, resume)) continueBlock(resume, blocks);
+    }
+
+    // Resume a block statement once one of its suites is finished: an if
+    // chain may go on with elif/else, every other block is complete.
+    void continueBlock(OpenBlock block, vector<OpenBlock>& blocks) {
+        while (block.conditional) {
+            if (match({"elif"})) {
+                block.ifChain->children.push_back(comparison_expr());
+                consume(":", "Expected ':' after elif condition");
+                if (suite(block.ifChain, blocks, block)) return;
+            } else if (match({"else"})) {
+                consume(":", "Expected ':' after else");
+                suite(block.conditional, blocks, OpenBlock{});
+                return;
+            } else {
+                return;
+            }
         }
-        return node;
     }
 
     // Special comparison expression handler for if statements
@@ -626,41 +1117,43 @@ private:
     }
 
     // Parse a loop statement
-    shared_ptr<ParseNode> loop() {
+    void loop(const shared_ptr<ParseNode>& parent, vector<OpenBlock>& blocks) {
         if (match({"while"})) {
             auto node = make_shared<ParseNode>("while_loop");
+            parent->children.push_back(node);
             node->children.push_back(expr());
             consume(":", "Expected ':' after while condition");
-            node->children.push_back(suite());
-            return node;
+            suite(node, blocks, OpenBlock{});
+            return;
         }
         if (match({"for"})) {
             auto node = make_shared<ParseNode>("for_loop");
-            node->children.push_back(make_shared<ParseNode>("NAME", consume("NAME", "Expected loop variable").value));
+            parent->children.push_back(node);
+            node->children.push_back(nameNode(consume("NAME", "Expected loop variable")));
             consume("in", "Expected 'in' after loop variable");
             node->children.push_back(expr());
             consume(":", "Expected ':' after for loop iterable");
-            node->children.push_back(suite());
-            return node;
+            suite(node, blocks, OpenBlock{});
+            return;
         }
         throw runtime_error("Unknown loop type");
     }
 
     // Parse a definition statement
-    shared_ptr<ParseNode> definition() {
-        if (match({"def"})) return func_def();
-        if (match({"class"})) return class_def();
+    void definition(const shared_ptr<ParseNode>& parent, vector<OpenBlock>& blocks) {
+        if (match({"def"})) return func_def(parent, blocks);
+        if (match({"class"})) return class_def(parent, blocks);
         throw runtime_error("Unknown definition type");
     }
 
     // Parse a function definition
-    shared_ptr<ParseNode> func_def() {
+    void func_def(const shared_ptr<ParseNode>& parent, vector<OpenBlock>& blocks) {
         auto node = make_shared<ParseNode>("func_def");
-        node->children.push_back(make_shared<ParseNode>("NAME", consume("NAME", "Expected function name").value));
+        parent->children.push_back(node);
+        node->children.push_back(nameNode(consume("NAME", "Expected function name")));
         node->children.push_back(params());
         consume(":", "Expected ':' after function parameters");
-        node->children.push_back(suite());
-        return node;
+        suite(node, blocks, OpenBlock{});
     }
 
     // Parse function parameters
@@ -668,10 +1161,10 @@ private:
         consume("(", "Expected '(' after function name");
         auto node = make_shared<ParseNode>("params");
         if (!check(")")) {
-            node->children.push_back(make_shared<ParseNode>("NAME", consume("NAME", "Expected parameter name").value));
+            node->children.push_back(nameNode(consume("NAME", "Expected parameter name")));
             while (match({","})) {
                 if (check(")")) break; // Handle trailing comma
-                node->children.push_back(make_shared<ParseNode>("NAME", consume("NAME", "Expected parameter name").value));
+                node->children.push_back(nameNode(consume("NAME", "Expected parameter name")));
             }
         }
         consume(")", "Expected ')' to close parameter list");
@@ -679,218 +1172,266 @@ private:
     }
 
     // Parse a class definition
-    shared_ptr<ParseNode> class_def() {
+    void class_def(const shared_ptr<ParseNode>& parent, vector<OpenBlock>& blocks) {
         auto node = make_shared<ParseNode>("class_def");
-        node->children.push_back(make_shared<ParseNode>("NAME", consume("NAME", "Expected class name").value));
+        parent->children.push_back(node);
+        node->children.push_back(nameNode(consume("NAME", "Expected class name")));
         if (match({"("})) {
-            node->children.push_back(make_shared<ParseNode>("NAME", consume("NAME", "Expected parent class name").value));
+            node->children.push_back(nameNode(consume("NAME", "Expected parent class name")));
             consume(")", "Expected ')' to close parent class list");
         }
         consume(":", "Expected ':' after class definition");
-        node->children.push_back(suite());
-        return node;
+        suite(node, blocks, OpenBlock{});
     }
 
-    // Parse a suite (indented block)
-    shared_ptr<ParseNode> suite() {
-        auto node = make_shared<ParseNode>("suite");
+    // Parse a suite (indented block) into owner. An indented body is pushed on
+    // blocks and filled in by stmt_list(); returns false for a one-line body,
+    // which is parsed right away.
+    bool suite(const shared_ptr<ParseNode>& owner, vector<OpenBlock>& blocks, OpenBlock resume) {
         cout << "In suite. Current token: " << peek().type << " '" << peek().value << "'" << endl;
+
+        // Handle INDENT directly or a NEWLINE followed by INDENT
+        if (check("NEWLINE")) advance();
         if (check("INDENT")) {
             advance();
-            while (!check("DEDENT") && !isAtEnd()) {
-                node->children.push_back(stmt());
-            }
-            if (check("DEDENT")) advance();
-            return node;
-        }
-        if (check("NEWLINE")) {
-            advance();
-            if (check("INDENT")) {
-                advance();
-                while (!check("DEDENT") && !isAtEnd()) {
-                    node->children.push_back(stmt());
-                }
-                if (check("DEDENT")) advance();
-                return node;
-            }
+            resume.suite = make_shared<ParseNode>("suite");
+            owner->children.push_back(resume.suite);
+            blocks.push_back(resume);
+            return true;
         }
-        return simple_stmts();
-    }
 
-    // Parse an expression
-    shared_ptr<ParseNode> expr() {
-        return logical_or();
+        // If we don't have an indented block, parse a simple statement
+        owner->children.push_back(simple_stmts());
+        return false;
     }
 
-    // Parse a logical OR expression
-    shared_ptr<ParseNode> logical_or() {
-        auto node = logical_and();
-        while (match({"or"})) {
-            auto op = make_shared<ParseNode>("or");
-            op->children.push_back(node);
-            op->children.push_back(logical_and());
-            node = op;
-        }
-        return node;
+    // Binary operator at the current token ("not in" and "is not" span two tokens)
+    const OperatorInfo* peekBinaryOperator(size_t& width) {
+        if (isAtEnd()) return nullptr;
+        const string& type = tokens[current].type;
+        width = 2;
+        if (type == "not" && peekAhead().type == "in") return findBinaryOperator("not in");
+        if (type == "is" && peekAhead().type == "not") return findBinaryOperator("is not");
+        width = 1;
+        return findBinaryOperator(type);
     }
 
-    // Parse a logical AND expression
-    shared_ptr<ParseNode> logical_and() {
-        auto node = logical_not();
-        while (match({"and"})) {
-            auto op = make_shared<ParseNode>("and");
-            op->children.push_back(node);
-            op->children.push_back(logical_not());
-            node = op;
-        }
-        return node;
-    }
+    // Operator waiting on the stack for its right operand
+    struct PendingOp {
+        string type;
+        int precedence;
+        bool unary;
+        bool arithmetic;
+    };
 
-    // Parse a logical NOT expression
-    shared_ptr<ParseNode> logical_not() {
-        if (match({"not"})) {
-            auto node = make_shared<ParseNode>("not");
-            node->children.push_back(logical_not());
-            return node;
-        }
-        return comparison();
-    }
+    // One bracketed level of the expression being parsed
+    struct ExprFrame {
+        string closer;                          // ")", "]", "}" or "" for the outermost level
+        vector<shared_ptr<ParseNode>> operands;
+        vector<PendingOp> operators;
+        vector<shared_ptr<ParseNode>> items;    // finished comma separated elements
+        bool afterComma = false;
+    };
 
-    // Parse a comparison
-    shared_ptr<ParseNode> comparison() {
-        auto node = arithmetic();
-        while (match({"<", ">", "==", ">=", "<=", "!="})) {
-            auto op = make_shared<ParseNode>(tokens[current-1].type);
-            op->children.push_back(node);
-            op->children.push_back(arithmetic());
-            node = op;
+    // Pop the top operator of frame and combine it with its operands
+    void reduce(ExprFrame& frame) {
+        PendingOp op = frame.operators.back();
+        frame.operators.pop_back();
+        auto right = frame.operands.back();
+        frame.operands.pop_back();
+        if (op.unary) {
+            auto node = make_shared<ParseNode>(op.type);
+            node->children.push_back(right);
+            frame.operands.push_back(node);
+            return;
         }
-        return node;
-    }
-
-    // Parse an arithmetic expression
-    shared_ptr<ParseNode> arithmetic() {
-        auto node = term();
-        while (match({"+", "-"})) {
-            auto op_node = make_shared<ParseNode>("");
-            op_node->children.push_back(node);
-            op_node->children.push_back(make_shared<ParseNode>(tokens[current-1].type));
-            op_node->children.push_back(term());
-            node = op_node;
+        auto left = frame.operands.back();
+        frame.operands.pop_back();
+        shared_ptr<ParseNode> node;
+        if (op.arithmetic) {
+            // Arithmetic keeps the operator as a middle child (drawn as arithm-op)
+            node = make_shared<ParseNode>("");
+            node->children.push_back(left);
+            node->children.push_back(make_shared<ParseNode>(op.type));
+        } else if (op.precedence == findBinaryOperator("==")->precedence &&
+                   (left->type == "comparison_chain" || (findBinaryOperator(left->type) && !left->children.empty() &&
+                    findBinaryOperator(left->type)->precedence == op.precedence))) {
+            // a < b <= c is one chain: [a, <, b, <=, c]
+            if (left->type == "comparison_chain") {
+                node = left;
+            } else {
+                node = make_shared<ParseNode>("comparison_chain");
+                node->children.push_back(left->children[0]);
+                node->children.push_back(make_shared<ParseNode>(left->type));
+                node->children.push_back(left->children[1]);
+            }
+            node->children.push_back(make_shared<ParseNode>(op.type));
+        } else {
+            node = make_shared<ParseNode>(op.type);
+            node->children.push_back(left);
         }
-        return node;
+        node->children.push_back(right);
+        frame.operands.push_back(node);
     }
 
-    // Parse a term
-    shared_ptr<ParseNode> term() {
-        auto node = factor();
-        while (match({"*", "/", "//", "%"})) {
-            auto op_node = make_shared<ParseNode>("");
-            op_node->children.push_back(node);
-            op_node->children.push_back(make_shared<ParseNode>(tokens[current-1].type));
-            op_node->children.push_back(factor());
-            node = op_node;
-        }
+    // Reduce everything pending in frame down to a single node
+    shared_ptr<ParseNode> reduceAll(ExprFrame& frame) {
+        while (!frame.operators.empty()) reduce(frame);
+        auto node = frame.operands.back();
+        frame.operands.clear();
         return node;
     }
 
-    // Parse a factor
-    shared_ptr<ParseNode> factor() {
-        if (match({"+", "-", "~"})) {
-            auto node = make_shared<ParseNode>(tokens[current-1].type);
-            node->children.push_back(factor());
-            return node;
-        }
-        return primary();
-    }
+    // Parse an expression in one precedence-climbing loop driven by
+    // binaryOperators. Operators and open brackets live on explicit stacks,
+    // so deep nesting never recurses and only real operators create nodes.
+    shared_ptr<ParseNode> expr() {
+        vector<ExprFrame> frames(1);
+        bool expectOperand = true;
+        string previous;  // operator just consumed, "" at the start of an element
+
+        while (true) {
+            ExprFrame& frame = frames.back();
+
+            if (expectOperand) {
+                if (check("not") && (previous.empty() || previous == "or" || previous == "and" || previous == "not")) {
+                    previous = advance().type;
+                    frame.operators.push_back({"not", notPrecedence, true, false});
+                    continue;
+                }
+                if (match({"+", "-", "~"})) {
+                    previous = tokens[current-1].type;
+                    frame.operators.push_back({previous, unaryPrecedence, true, false});
+                    continue;
+                }
+                if (check("(") || check("[") || check("{")) {
+                    string opener = advance().type;
+                    ExprFrame inner;
+                    inner.closer = opener == "(" ? ")" : opener == "[" ? "]" : "}";
+                    frames.push_back(inner);
+                    previous.clear();
+                    continue;
+                }
+                if (!frame.closer.empty() && check(frame.closer) && frame.operators.empty() &&
+                    (frame.items.empty() || frame.afterComma)) {
+                    // Empty brackets or a trailing comma
+                    closeFrame(frames);
+                    expectOperand = false;
+                    continue;
+                }
+                if (check("NUMBER") || check("BOOL") || check("STRING")) {
+                    Token literal = advance();
+                    frame.operands.push_back(tokenNode(literal, literal.type, literal.value));
+                } else if (check("None") || check("True") || check("False")) {
+                    Token constant = advance();
+                    frame.operands.push_back(tokenNode(constant, constant.type));
+                } else if (check("NAME")) {
+                    frame.operands.push_back(nameNode(advance()));
+                } else {
+                    throw runtime_error("Unknown primary expression type");
+                }
+                expectOperand = false;
+                continue;
+            }
 
-    // Parse a primary expression
-    shared_ptr<ParseNode> primary() {
-        if (check("NUMBER")) return make_shared<ParseNode>("NUMBER", advance().value);
-        if (check("BOOL")) return make_shared<ParseNode>("BOOL", advance().value);
-        if (check("STRING")) return make_shared<ParseNode>("STRING", advance().value);
-        if (check("None") || check("True") || check("False")) return make_shared<ParseNode>(advance().type);
-        if (check("NAME")) return make_shared<ParseNode>("NAME", advance().value);
-        if (check("(")) return grouped();
-        if (check("[")) return list_();
-        if (check("{")) return dict_();
-        throw runtime_error("Unknown primary expression type");
-    }
+            size_t width = 1;
+            if (const OperatorInfo* op = peekBinaryOperator(width)) {
+                while (!frame.operators.empty() &&
+                       (frame.operators.back().precedence > op->precedence ||
+                        (frame.operators.back().precedence == op->precedence && !op->rightAssoc))) {
+                    reduce(frame);
+                }
+                current += width;
+                previous = string(op->symbol);
+                frame.operators.push_back({previous, op->precedence, false, op->arithmetic});
+                expectOperand = true;
+                continue;
+            }
 
-    // Parse a grouped expression
-    shared_ptr<ParseNode> grouped() {
-        consume("(", "Expected '('");
-        auto node = make_shared<ParseNode>("grouped");
-        if (!check(")")) node->children.push_back(expr_list());
-        consume(")", "Expected ')'");
-        return node;
-    }
+            // No operator follows: the outermost expression is complete
+            if (frame.closer.empty()) break;
 
-    // Parse a list expression
-    shared_ptr<ParseNode> list_() {
-        consume("[", "Expected '['");
-        auto node = make_shared<ParseNode>("list");
-        if (!check("]")) node->children.push_back(expr_list());
-        consume("]", "Expected ']'");
-        return node;
-    }
+            bool isDict = frame.closer == "}";
+            if (check(",") || check(frame.closer)) {
+                if (isDict && frame.items.size() % 2 == 0) consume(":", "Expected ':' after dictionary key");
+                frame.items.push_back(reduceAll(frame));
+                if (check(frame.closer)) {
+                    closeFrame(frames);
+                } else {
+                    advance();
+                    frame.afterComma = true;
+                    expectOperand = true;
+                    previous.clear();
+                }
+                continue;
+            }
+            if (isDict && check(":") && frame.items.size() % 2 == 0) {
+                advance();
+                frame.items.push_back(reduceAll(frame));
+                frame.afterComma = false;
+                expectOperand = true;
+                previous.clear();
+                continue;
+            }
+            consume(frame.closer, "Expected '" + frame.closer + "'");
+        }
 
-    // Parse a dictionary expression
-    shared_ptr<ParseNode> dict_() {
-        consume("{", "Expected '{'");
-        auto node = make_shared<ParseNode>("dict");
-        if (!check("}")) node->children.push_back(key_values());
-        consume("}", "Expected '}'");
-        return node;
+        return reduceAll(frames.back());
     }
 
-    // Parse an expression list
-    shared_ptr<ParseNode> expr_list() {
-        auto node = make_shared<ParseNode>("expr_list");
-        node->children.push_back(expr());
-        while (match({","})) {
-            if (check(")") || check("]")) break; // Handle trailing comma
-            node->children.push_back(expr());
-        }
-        return node;
-    }
+    // Finish the innermost bracketed frame and hand its node to the enclosing one
+    void closeFrame(vector<ExprFrame>& frames) {
+        ExprFrame frame = move(frames.back());
+        frames.pop_back();
+        consume(frame.closer, "Expected '" + frame.closer + "'");
 
-    // Parse key-value pairs
-    shared_ptr<ParseNode> key_values() {
-        auto node = make_shared<ParseNode>("key_values");
-        node->children.push_back(expr());
-        consume(":", "Expected ':' after dictionary key");
-        node->children.push_back(expr());
-        while (match({","})) {
-            if (check("}")) break; // Handle trailing comma
-            node->children.push_back(expr());
-            consume(":", "Expected ':' after dictionary key");
-            node->children.push_back(expr());
+        shared_ptr<ParseNode> node;
+        shared_ptr<ParseNode> elements;
+        if (frame.closer == ")") {
+            node = make_shared<ParseNode>("grouped");
+            elements = make_shared<ParseNode>("expr_list");
+        } else if (frame.closer == "]") {
+            node = make_shared<ParseNode>("list");
+            elements = make_shared<ParseNode>("expr_list");
+        } else {
+            node = make_shared<ParseNode>("dict");
+            elements = make_shared<ParseNode>("key_values");
         }
-        return node;
+        if (!frame.items.empty()) {
+            elements->children = move(frame.items);
+            node->children.push_back(elements);
+        }
+        frames.back().operands.push_back(node);
     }
 
 public:
     // Generate DOT representation of the parse tree
-    void generateDOT(shared_ptr<ParseNode> node, ostream& dotFile, string parent = "") {
-        if (!node) return;
-        string nodeId = "node" + to_string(nodeCounter++);
-
-        // Determine if the node is a leaf (no children)
-        bool isLeaf = node->children.empty();
-
-        // Enhanced node styling, with different color for leaf nodes
-        dotFile << nodeId << " [" << "label=\"" << node->type;
-        if (!node->value.empty()) dotFile << "\\n" << node->value;
-        dotFile << "\", " << "shape=box, " << "style=\"rounded,filled\", " << "fillcolor=\"" << (isLeaf ? "#90EE90" : "#f0f0f0") << "\", "
-                << "fontname=\"Arial\", " << "fontsize=11, " << "penwidth=1.0" << "];\n";
-
-        if (!parent.empty()) {
-            dotFile << parent << " -> " << nodeId << " [penwidth=1.0, arrowsize=0.8];\n";
-        }
+    void generateDOT(shared_ptr<ParseNode> root, ostream& dotFile, string parent = "") {
+        // Pre-order walk on an explicit stack so deep trees don't recurse
+        vector<pair<shared_ptr<ParseNode>, string>> pending;
+        if (root) pending.push_back({root, parent});
+
+        while (!pending.empty()) {
+            auto [node, parentId] = pending.back();
+            pending.pop_back();
+            string nodeId = "node" + to_string(nodeCounter++);
+
+            // Determine if the node is a leaf (no children)
+            bool isLeaf = node->children.empty();
+
+            // Enhanced node styling, with different color for leaf nodes
+            dotFile << nodeId << " [" << "label=\"" << node->type;
+            if (!node->value.empty()) dotFile << "\\n" << node->value;
+            dotFile << "\", " << "shape=box, " << "style=\"rounded,filled\", " << "fillcolor=\"" << (isLeaf ? "#90EE90" : "#f0f0f0") << "\", "
+                    << "fontname=\"Arial\", " << "fontsize=11, " << "penwidth=1.0" << "];\n";
+
+            if (!parentId.empty()) {
+                dotFile << parentId << " -> " << nodeId << " [penwidth=1.0, arrowsize=0.8];\n";
+            }
 
-        for (auto& child : node->children) {
-            generateDOT(child, dotFile, nodeId);
+            for (auto it = node->children.rbegin(); it != node->children.rend(); ++it) {
+                if (*it) pending.push_back({*it, nodeId});
+            }
         }
     }
 
@@ -929,7 +1470,7 @@ public:
         ifstream file(filename);
         string line;
         regex lineRegex(R"(\[(\d+)\])");
-        regex tokenRegex(R"(<([^;]+);\s*([^>]*)>)");
+        regex tokenRegex(R"(<([^;<>]+);\s*(.*?)>(?=\s|$))");  // values may contain '>' (">=", "->")
         smatch matches;
 
         if (!file.is_open()) {
@@ -960,20 +1501,14 @@ public:
                         value.erase(0, value.find_first_not_of(" \t\n\r\f\v"));
                         value.erase(value.find_last_not_of(" \t\n\r\f\v") + 1);
 
-                        if (value == ">") type = ">";
-                        else if (value == "<") type = "<";
-                        else if (value == "==") type = "==";
-                        else if (value == ">=") type = ">=";
-                        else if (value == "<=") type = "<=";
-                        else if (value == "!=") type = "!=";
-                        else if (value == "=") type = "=";
-                        else if (value == "greater") type = ">";
-                        else type = value;
+                        const Lexeme* op = findLexeme(value);
+                        type = op && op->kind == LexemeKind::Operator ? string(op->type) : value;
                     }
                     else if (type == "Function") type = "NAME";
                     else if (type == "indent") type = "INDENT";
                     else if (type == "dedent") type = "DEDENT";
                     else if (type == "newline") type = "NEWLINE";
+                    else if (type == "error") lexicalErrorLines.insert(lineNum);
 
                     if (type == " " || type.empty()) {
                         searchStart = matches.suffix().first;
@@ -993,13 +1528,22 @@ public:
         cout << "Total tokens loaded: " << tokens.size() << endl;
     }
 
+    // Find where each loaded token sits in the source, given the flattened
+    // lines it was lexed from and their source maps
+    void locate(const vector<string>& lines, const vector<SourceMap>& maps) {
+        locateTokens(tokens, lines, maps);
+    }
+
+    // Syntax errors are collected in diagnostics; the tree keeps an error node for each
     shared_ptr<ParseNode> parse() {
         try {
             current = 0;
+            diagnostics.clear();
             auto root = program();
             if (!root) {
                 throw runtime_error("Failed to parse program: root node is null");
             }
+            spanTree(root);
             return root;
         } catch (const exception& e) {
             cerr << "Parse error: " << e.what() << endl;
@@ -1014,6 +1558,40 @@ public:
         }
     }
 
+    // parse() in slices, for a caller that mustn't block (the window, between
+    // frames): beginParse() starts over, and each parseFor() parses
+    // statements until budget runs out. It returns true, with the tree in
+    // root, once every token is parsed.
+    void beginParse() {
+        current = 0;
+        diagnostics.clear();
+        partial = StatementList();
+    }
+
+    bool parseFor(chrono::milliseconds budget, shared_ptr<ParseNode>& root) {
+        auto deadline = chrono::steady_clock::now() + budget;
+        try {
+            while (stmtStep(partial))
+                if (chrono::steady_clock::now() >= deadline) return false;
+            root = finishProgram(partial.node);
+            spanTree(root);
+        } catch (const exception& e) {
+            cerr << "Parse error: " << e.what() << endl;
+            root = nullptr;
+        }
+        partial = StatementList();
+        return true;
+    }
+
+    // Share of the tokens parsed so far
+    double parsedFraction() const {
+        return tokens.empty() ? 1.0 : double(min(current, tokens.size())) / double(tokens.size());
+    }
+
+    const vector<Diagnostic>& getDiagnostics() const {
+        return diagnostics;
+    }
+
     void createDirectoryIfNotExists(const string& path) {
         size_t pos = 0;
         do {
@@ -1067,13 +1645,6 @@ public:
 string output[500];
 int outputIndex = 0;
 
-unordered_set<string> keywords = {
-    "False", "await", "else", "import", "pass", "None", "break", "except",
-    "in", "raise", "True", "class", "finally", "is", "return", "and", "continue",
-    "for", "lambda", "try", "as", "def", "from", "nonlocal", "while", "assert",
-    "del", "global", "not", "with", "async", "elif", "if", "or", "yield"
-};
-
 bool isIdentifier(const string& word) {
     return regex_match(word, regex("[A-Za-z_][A-Za-z0-9_]*"));
 }
@@ -1089,7 +1660,7 @@ void storeOutput(const string& msg) {
 }
 
 void processToken(const string& token, int lineNumber) {
-    if (keywords.count(token))
+    if (isKeyword(token))
         storeOutput("Line " + to_string(lineNumber) + " - Keyword: " + token);
     else if (isNumber(token))
         storeOutput("Line " + to_string(lineNumber) + " - Number: " + token);
@@ -1211,7 +1782,10 @@ void analyzeLine(string& line, int lineNumber, stack<char>& brackets, ifstream&
                     storeOutput("Line " + to_string(lineNumber) + " - Symbol (closing bracket): " + string(1, ch));
                 }
             } else if (!isspace(ch) && !isalnum(ch) && ch != '_') {
-                storeOutput("Line " + to_string(lineNumber) + " - Symbol: " + string(1, ch));
+                // Maximal munch: "**=" is one symbol, not three
+                size_t length = longestOperator(string_view(line).substr(i));
+                storeOutput("Line " + to_string(lineNumber) + " - Symbol: " + line.substr(i, length));
+                i += length - 1;
             }
         }
     }
@@ -1249,32 +1823,196 @@ struct SymbolInfo {
 
 map<string, SymbolInfo> symbolTable;
 
+// Merge inferred types into a symbol table. Every bound name gets a row,
+// including defs and parameters the token scan never sees.
+void applyInferredTypes(map<string, SymbolInfo>& table, const map<string, string>& inferredTypes) {
+    for (const auto& [name, type] : inferredTypes) {
+        SymbolInfo& info = table[name];
+        info.name = name;
+        if (type != "N/A") info.type = type;
+    }
+}
+
+// [A-Za-z0-9_], regex's \w
+bool isWordByte(unsigned char c) {
+    return isalnum(c) || c == '_';
+}
+
+// Token lines are scanned by hand where a regex would recurse once per
+// byte of a long value, as in a list of thousands of numbers
+struct LineScanner {
+    string_view text;
+    size_t at = 0;
+
+    bool literal(string_view expected) {
+        if (text.substr(at, expected.size()) != expected) return false;
+        at += expected.size();
+        return true;
+    }
+    void spaces() {
+        while (at < text.size() && isspace((unsigned char)text[at])) ++at;
+    }
+    // Length of the run of bytes accepted from here on
+    template <typename Accept>
+    size_t run(Accept accept) {
+        size_t start = at;
+        while (at < text.size() && accept((unsigned char)text[at])) ++at;
+        return at - start;
+    }
+};
+
+// The value of a <type;\s*([^>]+)\s*> token, given the byte after its ';':
+// up to the next '>', less leading spaces but never less than one byte.
+// false when the value is empty or never closed.
+bool tokenValue(const string& line, size_t at, size_t& value, size_t& close) {
+    close = line.find('>', at);
+    if (close == string::npos || close == at) return false;
+    value = at;
+    while (value + 1 < close && isspace((unsigned char)line[value])) ++value;
+    return true;
+}
+
+// A token as <(type|...);\s*([^>]+)\s*> finds it
+struct TypedToken {
+    size_t start = 0, value = 0, close = 0;  // its '<', value and '>'
+    string_view type;
+
+    string text(const string& line) const { return line.substr(value, close - value); }
+};
+
+// The first token at or after from whose type is one of types
+bool findTypedToken(const string& line, size_t from, initializer_list<string_view> types, TypedToken& token) {
+    for (size_t open = line.find('<', from); open != string::npos; open = line.find('<', open + 1)) {
+        for (string_view type : types) {
+            size_t semicolon = open + 1 + type.size();
+            if (line.compare(open + 1, type.size(), type) != 0 || semicolon >= line.size() || line[semicolon] != ';')
+                continue;
+            if (!tokenValue(line, semicolon + 1, token.value, token.close)) break;
+            token.start = open;
+            token.type = type;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The list assignment in a token line, as
+// <id;\s*(\w+)\s*>\s*<symbol;\s*=>\s*<symbol;\s*\[>\s*((?:<(int|float);\s*[^>]+>\s*(?:<symbol;\s*,>\s*)?)*)<symbol;\s*\]>
+// matches it. The nested quantifier backtracked on long lists that almost
+// matched; an item always opens with <int; or <float; and closes at its
+// first '>', so one forward walk decides it. values gets "[1,2.5]".
+bool matchListAssignment(const string& line, string& var, string& values) {
+    for (size_t start = line.find("<id;"); start != string::npos; start = line.find("<id;", start + 1)) {
+        LineScanner scan{line, start + 4};
+        scan.spaces();
+        size_t name = scan.at, nameLength = scan.run(isWordByte);
+        scan.spaces();
+        if (!nameLength || !scan.literal(">")) continue;
+        scan.spaces();
+        if (!scan.literal("<symbol;")) continue;
+        scan.spaces();
+        if (!scan.literal("=>")) continue;
+        scan.spaces();
+        if (!scan.literal("<symbol;")) continue;
+        scan.spaces();
+        if (!scan.literal("[>")) continue;
+        scan.spaces();
+
+        string items = "[";
+        bool complete = true;
+        while (scan.literal("<int;") || scan.literal("<float;")) {
+            size_t value, close;
+            if (!tokenValue(line, scan.at, value, close)) {
+                complete = false;
+                break;
+            }
+            if (items.size() > 1) items += ',';
+            items.append(line, value, close - value);
+            scan.at = close + 1;
+            scan.spaces();
+            size_t comma = scan.at;
+            if (!scan.literal("<symbol;")) continue;
+            scan.spaces();
+            if (scan.literal(",>")) scan.spaces();
+            else scan.at = comma;
+        }
+        if (!complete || !scan.literal("<symbol;")) continue;
+        scan.spaces();
+        if (!scan.literal("]>")) continue;
+        var = line.substr(name, nameLength);
+        values = items + "]";
+        return true;
+    }
+    return false;
+}
+
+// Value of a constant-folding operand, false unless it is a finite int or
+// float literal (an unknown name or a list can't be folded)
+bool foldableValue(const string& type, const string& text, double& value) {
+    if (type != "int" && type != "float" && type != "number") return false;
+    char* end = nullptr;
+    errno = 0;
+    value = strtod(text.c_str(), &end);
+    return end != text.c_str() && *end == '\0' && errno == 0 && isfinite(value);
+}
+
+// Whether the token at at is followed by " <symbol;" whose value starts with
+// one of ops, which the folding patterns need before their regex can match
+bool operatorFollows(const string& line, size_t at, string_view ops) {
+    size_t close = line.find('>', at);
+    if (close == string::npos) return false;
+    LineScanner scan{line, close + 1};
+    if (!scan.literal(" <symbol;")) return false;
+    scan.spaces();
+    return scan.at < line.size() && ops.find(line[scan.at]) != string_view::npos;
+}
+
+// Where pattern first matches at or after from, or npos. Every pattern the
+// sanitizer uses starts with prefix, so only the places prefix occurs are
+// tried (and with ops, only those operatorFollows); regex_search would set
+// up a match attempt at every byte of a long line.
+size_t searchFrom(const string& line, size_t from, string_view prefix, const regex& pattern, smatch& match,
+                  string_view ops = {}) {
+    for (size_t at = line.find(prefix, from); at != string::npos; at = line.find(prefix, at + 1)) {
+        if (!ops.empty() && !operatorFollows(line, at, ops)) continue;
+        if (regex_search(line.cbegin() + at, line.cend(), match, pattern, regex_constants::match_continuous)) return at;
+    }
+    return string::npos;
+}
+
 vector<string> sanitize_tokens_vector(const vector<string>& token_lines) {
     vector<string> sanitized_tokens;
 
-    regex malformed_double_assign(R"(<symbol;\s*=>\s*>\s*<symbol;\s*=>\s*>)");
-    regex float_parts(R"(<number;\s*(\d+)\s*> <symbol;\s*\.{1}\s*> <number;\s*(\d+)\s*>)");
-    regex func_call(R"(<id;\s*([^>]+)\s*>\s*<symbol;\s*\(\s*>)");
-    regex number_token(R"(<number;\s*(\d+)\s*>)");
-    regex math_expr(R"(<(id|number|float|int);\s*([^>]+)\s*> <symbol;\s*([+\-*/])\s*> <(id|number|float|int);\s*([^>]+)\s*>)");
+    static const regex float_parts(R"(<number;\s*(\d+)\s*> <symbol;\s*\.{1}\s*> <number;\s*(\d+)\s*>)");
+    static const regex func_call(R"(<id;\s*([^>]+)\s*>\s*<symbol;\s*\(\s*>)");
+    static const regex number_token(R"(<number;\s*(\d+)\s*>)");
+    static const regex number_assignment(R"(<id;\s*(\w+)\s*>\s*<symbol;\s*=>\s*<(int|float);\s*([\d\.]+)\s*>)");
+    static const regex math_expr(R"(<(id|number|float|int);\s*([^>]+)\s*> <symbol;\s*([+\-*/])\s*> <(id|number|float|int);\s*([^>]+)\s*>)");
 
     for (string line : token_lines) {
-        line = regex_replace(line, malformed_double_assign, "<symbol; ==>");
-
         // Handle math expressions
         smatch math_match;
-        while (regex_search(line, math_match, math_expr)) {
+        size_t from = 0;  // expressions before this can't be folded
+        for (size_t at; (at = searchFrom(line, from, "<", math_expr, math_match, "+-*/")) != string::npos;) {
             string left_type = math_match[1], left_val = math_match[2];
             string op = math_match[3];
             string right_type = math_match[4], right_val = math_match[5];
 
-            if (left_type == "id" && symbolTable.count(left_val))
-                left_val = symbolTable[left_val].value, left_type = symbolTable[left_val].type;
-            if (right_type == "id" && symbolTable.count(right_val))
-                right_val = symbolTable[right_val].value, right_type = symbolTable[right_val].type;
+            if (left_type == "id" && symbolTable.count(left_val)) {
+                const SymbolInfo& known = symbolTable[left_val];
+                left_val = known.value, left_type = known.type;
+            }
+            if (right_type == "id" && symbolTable.count(right_val)) {
+                const SymbolInfo& known = symbolTable[right_val];
+                right_val = known.value, right_type = known.type;
+            }
 
-            double left = (left_type == "float") ? stod(left_val) : stoi(left_val);
-            double right = (right_type == "float") ? stod(right_val) : stoi(right_val);
+            double left = 0, right = 0;
+            if (!foldableValue(left_type, left_val, left) || !foldableValue(right_type, right_val, right) ||
+                (op == "/" && right == 0)) {
+                from = at + 1;
+                continue;
+            }
             double result = 0;
             string result_type = "int";
 
@@ -1282,48 +2020,50 @@ vector<string> sanitize_tokens_vector(const vector<string>& token_lines) {
             else if (op == "-") result = left - right;
             else if (op == "*") result = left * right;
             else if (op == "/") {
-                if (right == 0) break;
                 result = left / right;
                 result_type = "float";
             }
 
-            if (result_type == "int" && result != int(result))
+            if (result_type == "int" && (result != floor(result) || fabs(result) > INT_MAX))
                 result_type = "float";
 
             string result_token = (result_type == "int")
                                       ? "<int; " + to_string(int(result)) + ">"
                                       : "<float; " + to_string(result) + ">";
 
-            line.replace(math_match.position(0), math_match.length(0), result_token);
+            line.replace(at, size_t(math_match.length(0)), result_token);
+            from = at;  // the result may fold with what follows
         }
 
         // Handle floats like 2 . 4 → <float; 2.4>
         smatch float_match;
-        while (regex_search(line, float_match, float_parts)) {
-            string fullFloat = float_match[1].str() + "." + float_match[2].str();
-            line.replace(float_match.position(0), float_match.length(0), "<float; " + fullFloat + ">");
+        for (size_t at = 0; (at = searchFrom(line, at, "<number;", float_parts, float_match, ".")) != string::npos;) {
+            string replacement = "<float; " + float_match[1].str() + "." + float_match[2].str() + ">";
+            line.replace(at, size_t(float_match.length(0)), replacement);
+            at += replacement.size();
         }
 
         // Replace numbers with ints
         smatch number_match;
-        while (regex_search(line, number_match, number_token)) {
-            string intVal = number_match[1].str();
-            line.replace(number_match.position(0), number_match.length(0), "<int; " + intVal + ">");
+        for (size_t at = 0; (at = searchFrom(line, at, "<number;", number_token, number_match)) != string::npos;) {
+            string replacement = "<int; " + number_match[1].str() + ">";
+            line.replace(at, size_t(number_match.length(0)), replacement);
+            at += replacement.size();
         }
 
         // Replace function names
         smatch func_match;
-        while (regex_search(line, func_match, func_call)) {
+        for (size_t at = 0; (at = searchFrom(line, at, "<id;", func_call, func_match)) != string::npos;) {
             string funcName = func_match[1].str();
             string replacement = "<Function; " + funcName + ">";
-            size_t pos = line.find("<id; " + funcName + ">", func_match.position(0));
-            if (pos != string::npos)
-                line.replace(pos, 8 + funcName.size() + 1, replacement);
+            string idToken = "<id; " + funcName + ">";
+            size_t pos = line.find(idToken, at);
+            if (pos == string::npos) break;
+            line.replace(pos, idToken.size(), replacement);
+            at = pos + replacement.size();
         }
 
         // List detection (like: <id; pp> <symbol; => <symbol; [> <int; 1> <symbol; ,> ... <symbol; ]>)
-        smatch list_match;
-        regex list_expr(R"(<id;\s*(\w+)\s*>\s*<symbol;\s*=>\s*<symbol;\s*\[>\s*((?:<(int|float);\s*[^>]+>\s*(?:<symbol;\s*,>\s*)?)*)<symbol;\s*\]>)");
 
         // Save line number prefix like "[1] "
         string line_number_prefix = "";
@@ -1333,24 +2073,8 @@ vector<string> sanitize_tokens_vector(const vector<string>& token_lines) {
             line = line.substr(bracket_pos + 2); // Skip "] "
         }
 
-        if (regex_search(line, list_match, list_expr)) {
-            string var = list_match[1];
-            string inner = list_match[2];
-
-            // Extract all numbers
-            regex item(R"(<(int|float);\s*([^>]+)\s*>)");
-            smatch m;
-            string items = "[";
-            string temp = inner;
-            bool first = true;
-            while (regex_search(temp, m, item)) {
-                if (!first) items += ",";
-                items += m[2].str();
-                temp = m.suffix();
-                first = false;
-            }
-            items += "]";
-
+        string var, items;
+        if (matchListAssignment(line, var, items)) {
             line = "<id; " + var + "> <symbol; => <list; " + items + ">";
             symbolTable[var] = SymbolInfo{var, "list", items};
         }
@@ -1360,7 +2084,7 @@ vector<string> sanitize_tokens_vector(const vector<string>& token_lines) {
 
         // Assignment handling for int/float
         smatch assign_match;
-        if (regex_search(line, assign_match, regex(R"(<id;\s*(\w+)\s*>\s*<symbol;\s*=>\s*<(int|float);\s*([\d\.]+)\s*>)"))) {
+        if (searchFrom(line, 0, "<id;", number_assignment, assign_match) != string::npos) {
             string var = assign_match[1];
             string type = assign_match[2];
             string val = assign_match[3];
@@ -1372,13 +2096,6 @@ vector<string> sanitize_tokens_vector(const vector<string>& token_lines) {
         while ((pos = line.find('"')) != string::npos)
             line.replace(pos, 1, "'");
 
-        // Fix malformed >ymbol
-        string from1 = ">ymbol;";
-        string to1 = "> <symbol;";
-        size_t pos1 = line.find(from1);
-        if (pos1 != string::npos)
-            line.replace(pos1, from1.length(), to1);
-
         // Handle bools
         line = regex_replace(
             line,
@@ -1496,82 +2213,145 @@ vector<string> parse_token_lines(const string arr[], int size) {
 
 void build_and_draw_symbol_table(const vector<string>& token_lines) {
     map<string, SymbolInfo> symbol_map;
-    regex id_pattern(R"(<id;\s*([^>]+)\s*>)");
-    regex assign_pattern(R"(<symbol;\s*=>\s*>)");
-    regex value_pattern(R"(<(float|int|string|id|bool|list);\s*([^>]+)\s*>)");
-    regex direct_assignment_pattern(R"(<id;\s*(\w+)\s*>\s*<symbol;\s*=>\s*<(int|float|string|bool|list);\s*([^>]+)\s*>)");
-
     for (const string& line : token_lines) {
         if (line.find("<Function;") != string::npos) continue;
 
-        smatch assign_match;
-        if (regex_search(line, assign_match, direct_assignment_pattern)) {
-            string id = assign_match[1];
-            string type = assign_match[2];
-            string value = assign_match[3];
-            symbol_map[id] = SymbolInfo{id, type, value};
+        // <id;\s*(\w+)\s*>\s*<symbol;\s*=>\s*<(int|float|string|bool|list);\s*([^>]+)\s*>
+        for (size_t start = line.find("<id;"); start != string::npos; start = line.find("<id;", start + 1)) {
+            LineScanner scan{line, start + 4};
+            scan.spaces();
+            size_t name = scan.at, nameLength = scan.run(isWordByte);
+            scan.spaces();
+            if (!nameLength || !scan.literal(">")) continue;
+            scan.spaces();
+            if (!scan.literal("<symbol;")) continue;
+            scan.spaces();
+            if (!scan.literal("=>")) continue;
+            scan.spaces();
+            TypedToken value;
+            if (!findTypedToken(line, scan.at, {"int", "float", "string", "bool", "list"}, value) || value.start != scan.at)
+                continue;
+            string id = line.substr(name, nameLength);
+            symbol_map[id] = SymbolInfo{id, string(value.type), value.text(line)};
+            break;
         }
 
-        sregex_iterator it(line.begin(), line.end(), id_pattern);
-        sregex_iterator end;
-
-        while (it != end) {
-            string id = (*it)[1];
+        TypedToken idToken;
+        for (size_t from = 0; findTypedToken(line, from, {"id"}, idToken); from = idToken.close + 1) {
+            string id = idToken.text(line);
             if (symbol_map.count(id) == 0) {
                 symbol_map[id] = SymbolInfo{id};
             }
-            size_t id_pos = it->position();
-            size_t eq_pos = line.find("<symbol; =>", id_pos);
-            if (eq_pos != string::npos) {
-                smatch match;
-                string rest = line.substr(eq_pos);
-                if (regex_search(rest, match, value_pattern)) {
-                    symbol_map[id].type = match[1];
-                    symbol_map[id].value = match[2];
-                }
+            size_t eq_pos = line.find("<symbol; =>", idToken.start);
+            TypedToken value;
+            if (eq_pos != string::npos &&
+                findTypedToken(line, eq_pos, {"float", "int", "string", "id", "bool", "list"}, value)) {
+                symbol_map[id].type = string(value.type);
+                symbol_map[id].value = value.text(line);
             }
-            ++it;
         }
     }
     symbolTable = symbol_map;
 }
 
-ifstream flatten_multiline_file(ifstream& inputFile) {
-    vector<string> result;
-    bool in_multiline = false;
-    string multiline_delim;
-    string combined;
+// Join each triple-quoted string onto one line, replacing the quotes with ",
+// reading one result line at a time. An unterminated string at the end of
+// the input is dropped.
+class LineFlattener {
+public:
+    explicit LineFlattener(istream& in) : in(in) {}
+
+    // Next line, and the source line (1-based) it starts on. `map`, if
+    // given, receives where each of its bytes came from in the source.
+    bool next(string& result, int& firstLine, SourceMap* map = nullptr) {
+        bool in_multiline = false;
+        string multiline_delim;
+        string combined;
+        SourceMap pieces;
+
+        // Replace all triple quotes with ", keeping the map in step
+        auto collapseQuotes = [&]() {
+            for (size_t at; (at = combined.find(multiline_delim)) != string::npos;) {
+                uint32_t after = pieces.sourceOffset(uint32_t(at + 3));
+                combined.replace(at, 3, "\"");
+                for (auto& piece : pieces.pieces)
+                    if (piece.first > at) piece.first -= 2;
+                pieces.pieces.insert(upper_bound(pieces.pieces.begin(), pieces.pieces.end(), make_pair(uint32_t(at + 1), 0u)),
+                                     {uint32_t(at + 1), after});
+            }
+        };
 
-    string line;
-    while (getline(inputFile, line)) {
-        if (!in_multiline) {
-            size_t pos_triple_double = line.find("\"\"\"");
-            size_t pos_triple_single = line.find("'''");
-            if (pos_triple_double != string::npos || pos_triple_single != string::npos) {
-                in_multiline = true;
-                multiline_delim = (pos_triple_double != string::npos) ? "\"\"\"" : "'''";
-                combined = line;
-                size_t end_pos = line.find(multiline_delim, (pos_triple_double != string::npos ? pos_triple_double + 3 : pos_triple_single + 3));
-                if (end_pos != string::npos && end_pos > (pos_triple_double != string::npos ? pos_triple_double + 2 : pos_triple_single + 2)) {
-                    in_multiline = false;
-                    while (combined.find(multiline_delim) != string::npos)
-                        combined.replace(combined.find(multiline_delim), 3, "\"");
-                    result.push_back(combined);
+        string line;
+        while (getline(in, line)) {
+            ++lineNumber;
+            uint64_t lineStart = consumed;
+            consumed += line.size() + 1;
+            if (lineStart > UINT32_MAX) throw runtime_error("Source larger than 4 GiB");
+            if (!in_multiline) {
+                size_t pos_triple_double = line.find("\"\"\"");
+                size_t pos_triple_single = line.find("'''");
+                pieces.pieces.assign(1, {0u, uint32_t(lineStart)});
+
+                if (pos_triple_double != string::npos || pos_triple_single != string::npos) {
+                    in_multiline = true;
+                    multiline_delim = (pos_triple_double != string::npos) ? "\"\"\"" : "'''";
+                    combined = line;
+                    firstLine = lineNumber;
+
+                    size_t end_pos = line.find(multiline_delim, (pos_triple_double != string::npos ? pos_triple_double + 3 : pos_triple_single + 3));
+                    if (end_pos != string::npos && end_pos > (pos_triple_double != string::npos ? pos_triple_double + 2 : pos_triple_single + 2)) {
+                        collapseQuotes();
+                        result = move(combined);
+                        if (map) *map = move(pieces);
+                        return true;
+                    }
+                } else {
+                    result = move(line);
+                    firstLine = lineNumber;
+                    if (map) *map = move(pieces);
+                    return true;
                 }
             } else {
-                result.push_back(line);
-            }
-        } else {
-            combined += " " + line;
-            if (line.find(multiline_delim) != string::npos) {
-                in_multiline = false;
-                while (combined.find(multiline_delim) != string::npos)
-                    combined.replace(combined.find(multiline_delim), 3, "\"");
-                result.push_back(combined);
+                // The joining space stands for the line break before the line
+                pieces.pieces.push_back({uint32_t(combined.size()), uint32_t(lineStart - 1)});
+                combined += " " + line;
+                if (line.find(multiline_delim) != string::npos) {
+                    collapseQuotes();
+                    result = move(combined);
+                    if (map) *map = move(pieces);
+                    return true;
+                }
             }
         }
+        return false;
+    }
+
+private:
+    istream& in;
+    int lineNumber = 0;
+    uint64_t consumed = 0;  // source bytes read, line breaks included
+};
+
+// All lines of LineFlattener at once. firstLines, if given, receives the
+// source line each result line starts on, and maps where its bytes came from.
+vector<string> flatten_multiline_lines(istream& inputFile, vector<int>* firstLines = nullptr, vector<SourceMap>* maps = nullptr) {
+    vector<string> result;
+    LineFlattener flattener(inputFile);
+    string line;
+    int firstLine;
+    SourceMap map;
+    while (flattener.next(line, firstLine, maps ? &map : nullptr)) {
+        result.push_back(move(line));
+        if (firstLines) firstLines->push_back(firstLine);
+        if (maps) maps->push_back(move(map));
     }
+    return result;
+}
 
+ifstream flatten_multiline_file(ifstream& inputFile, vector<SourceMap>* maps = nullptr) {
+    vector<string> result = flatten_multiline_lines(inputFile, nullptr, maps);
+
+    // Save to a temporary file
     ofstream tempOut("temp_flattened.py");
     for (const string& l : result) {
         tempOut << l << "\n";
@@ -1595,6 +2375,991 @@ void saveTokensToFile(const vector<string>& tokens) {
     outFile.close();
 }
 
+// Scope analysis over the parse tree: module, function and class scopes,
+// each NAME use resolved to the (depth, slot) of its binding, plus reports
+// of undefined and shadowed names. Bindings are collected in one walk and
+// uses resolved afterwards, so a function may use names bound later in the
+// file, as Python allows.
+
+// Names are interned once so scopes hash and compare 32-bit ids, not strings
+class NameInterner {
+public:
+    uint32_t intern(const string& name) {
+        auto it = ids.find(name);
+        if (it != ids.end()) return it->second;
+        uint32_t id = uint32_t(names.size());
+        names.push_back(name);
+        ids.emplace(name, id);
+        return id;
+    }
+
+    const string& name(uint32_t id) const { return names[id]; }
+
+private:
+    unordered_map<string, uint32_t> ids;
+    vector<string> names;
+};
+
+constexpr string_view builtinNames[] = {
+    "print", "len", "range", "int", "str", "float", "bool", "list", "dict", "set",
+    "tuple", "abs", "max", "min", "sum", "open", "input", "type", "dir", "help",
+    "enumerate", "zip", "map", "filter", "sorted", "reversed", "isinstance", "super",
+    "object", "iter", "next", "any", "all", "round", "repr", "chr", "ord", "format",
+    "getattr", "setattr", "hasattr", "Exception", "ValueError", "TypeError",
+    "KeyError", "IndexError", "__name__",
+};
+
+enum class ScopeKind { Module, Function, Class };
+enum class BindingKind { Variable, Parameter, Function, Class, Import, LoopVariable };
+
+struct ScopeSymbol {
+    uint32_t name;
+    BindingKind kind;
+    int line;
+};
+
+// A scope's symbols live in slot order; `table` is an open-addressing index
+// over them (linear probing, power-of-two size, kept at most half full)
+struct Scope {
+    ScopeKind kind;
+    string name;
+    int parent;  // index into SemanticResult::scopes, -1 for the module
+    int depth;   // 0 for the module
+    int line;
+    const ParseNode* node;  // the func_def/class_def, or the program root
+    vector<ScopeSymbol> symbols;
+    vector<int32_t> table = vector<int32_t>(8, -1);
+
+    static size_t hashName(uint32_t name) { return size_t(name * 0x9E3779B1u); }
+
+    int find(uint32_t name) const {
+        size_t mask = table.size() - 1;
+        for (size_t i = hashName(name) & mask;; i = (i + 1) & mask) {
+            int32_t slot = table[i];
+            if (slot < 0) return -1;
+            if (symbols[slot].name == name) return slot;
+        }
+    }
+
+    // Slot of name in this scope, adding it if it isn't bound here yet
+    int bind(uint32_t name, BindingKind kind, int line, bool& added) {
+        if ((symbols.size() + 1) * 2 > table.size()) grow();
+        size_t mask = table.size() - 1;
+        size_t i = hashName(name) & mask;
+        for (; table[i] >= 0; i = (i + 1) & mask) {
+            if (symbols[table[i]].name == name) {
+                added = false;
+                return table[i];
+            }
+        }
+        table[i] = int32_t(symbols.size());
+        symbols.push_back({name, kind, line});
+        added = true;
+        return table[i];
+    }
+
+private:
+    void grow() {
+        vector<int32_t> larger(table.size() * 2, -1);
+        size_t mask = larger.size() - 1;
+        for (size_t slot = 0; slot < symbols.size(); ++slot) {
+            size_t i = hashName(symbols[slot].name) & mask;
+            while (larger[i] >= 0) i = (i + 1) & mask;
+            larger[i] = int32_t(slot);
+        }
+        table.swap(larger);
+    }
+};
+
+// A NAME and where it resolved: depth of the binding scope and the slot in
+// it, or depth -1 for builtins and undefined names
+struct NameRef {
+    const ParseNode* node;
+    int scope;
+    int depth;
+    int slot;
+};
+
+struct SemanticResult {
+    NameInterner names;
+    uint32_t builtinCount = 0;  // ids below this are builtins
+    vector<Scope> scopes;
+    vector<NameRef> refs;       // uses
+    vector<NameRef> bindings;   // binding occurrences (targets, params, def names, ...)
+    vector<Diagnostic> undefinedNames;
+    vector<Diagnostic> shadowedNames;
+};
+
+// Scope that binds name as seen from scope (class bodies are only visible
+// from themselves, not from scopes nested in them), or -1. With
+// includeScope false only the enclosing scopes are searched.
+int resolveScope(const SemanticResult& result, uint32_t name, int scope, int& slot, bool includeScope = true) {
+    for (int s = scope; s >= 0; s = result.scopes[s].parent) {
+        if (s == scope ? !includeScope : result.scopes[s].kind == ScopeKind::Class) continue;
+        if ((slot = result.scopes[s].find(name)) >= 0) return s;
+    }
+    return -1;
+}
+
+SemanticResult analyzeScopes(const shared_ptr<ParseNode>& root) {
+    SemanticResult result;
+    for (string_view builtin : builtinNames) result.names.intern(string(builtin));
+    result.builtinCount = uint32_t(size(builtinNames));
+    result.scopes.push_back(Scope{ScopeKind::Module, "<module>", -1, 0, 0, root.get(), {}});
+    if (!root) return result;
+
+    vector<pair<const ParseNode*, int>> uses;
+    auto bindName = [&](const ParseNode* name, int scope, BindingKind kind) {
+        bool added = false;
+        int slot = result.scopes[scope].bind(result.names.intern(name->value), kind, name->line, added);
+        result.bindings.push_back({name, scope, result.scopes[scope].depth, slot});
+    };
+    auto isName = [](const shared_ptr<ParseNode>& node) { return node && node->type == "NAME"; };
+
+    // Collect every binding and use; explicit stack so deep trees are fine
+    vector<pair<const ParseNode*, int>> pending = {{root.get(), 0}};
+    while (!pending.empty()) {
+        auto [node, scope] = pending.back();
+        pending.pop_back();
+        const auto& children = node->children;
+        size_t first = 0;  // children before this one were handled here
+
+        if (node->type == "NAME") {
+            uses.push_back({node, scope});
+            continue;
+        } else if (node->type == "assignment" && !children.empty() && children[0]) {
+            bool augmented = children.size() > 1 && children[1] && children[1]->value != "=";
+            for (const auto& target : children[0]->children) {
+                if (!isName(target)) continue;
+                if (augmented) uses.push_back({target.get(), scope});
+                bindName(target.get(), scope, BindingKind::Variable);
+            }
+            first = 1;
+        } else if (node->type == "for_loop" && !children.empty() && isName(children[0])) {
+            bindName(children[0].get(), scope, BindingKind::LoopVariable);
+            first = 1;
+        } else if ((node->type == "func_def" || node->type == "class_def") && !children.empty() && isName(children[0])) {
+            bool isFunction = node->type == "func_def";
+            const ParseNode* name = children[0].get();
+            bindName(name, scope, isFunction ? BindingKind::Function : BindingKind::Class);
+            first = 1;
+            if (!isFunction && children.size() > 1 && isName(children[1])) {
+                uses.push_back({children[1].get(), scope});  // base class
+                first = 2;
+            }
+            result.scopes.push_back(Scope{isFunction ? ScopeKind::Function : ScopeKind::Class, name->value,
+                                          scope, result.scopes[scope].depth + 1, name->line, node, {}});
+            scope = int(result.scopes.size()) - 1;
+            if (isFunction && children.size() > 1 && children[1] && children[1]->type == "params") {
+                for (const auto& param : children[1]->children)
+                    if (isName(param)) bindName(param.get(), scope, BindingKind::Parameter);
+                first = 2;
+            }
+        } else if (node->type == "import_decl") {
+            // import a.b / import a as b / from a import b [as c]: the last
+            // NAME after a module_ref is the bound alias, else the module
+            // itself; `from a import *` binds nothing that can be seen here
+            if (node->value == "from" && (children.size() < 2 || !isName(children[1]))) continue;
+            for (size_t i = 0; i < children.size(); ++i) {
+                if (!children[i] || children[i]->type != "module_ref") continue;
+                size_t last = i;
+                while (last + 1 < children.size() && isName(children[last + 1])) ++last;
+                const ParseNode* bound = last > i ? children[last].get()
+                                       : !children[i]->children.empty() ? children[i]->children[0].get() : nullptr;
+                if (bound) bindName(bound, scope, BindingKind::Import);
+            }
+            continue;
+        } else if (node->type == "module_ref") {
+            // a.b.c used as a value: only the head is looked up
+            if (!children.empty() && isName(children[0])) uses.push_back({children[0].get(), scope});
+            continue;
+        }
+
+        for (size_t i = children.size(); i-- > first;)
+            if (children[i]) pending.push_back({children[i].get(), scope});
+    }
+
+    // Resolve uses now that every scope is complete
+    result.refs.reserve(uses.size());
+    for (auto [node, scope] : uses) {
+        uint32_t name = result.names.intern(node->value);
+        int slot = -1;
+        int owner = resolveScope(result, name, scope, slot);
+        result.refs.push_back({node, scope, owner >= 0 ? result.scopes[owner].depth : -1, slot});
+        if (owner < 0 && name >= result.builtinCount)
+            result.undefinedNames.push_back({node->line, 0, "undefined name '" + node->value + "'", node->begin, node->end - node->begin});
+    }
+
+    // A binding shadows whatever the same name resolves to one scope further out
+    for (size_t s = 0; s < result.scopes.size(); ++s) {
+        const Scope& scope = result.scopes[s];
+        for (const ScopeSymbol& symbol : scope.symbols) {
+            const string& name = result.names.name(symbol.name);
+            int slot = -1;
+            int outer = resolveScope(result, symbol.name, int(s), slot, false);
+            if (outer >= 0) {
+                const Scope& enclosing = result.scopes[outer];
+                result.shadowedNames.push_back({symbol.line, 0, "'" + name + "' in " + scope.name + " shadows '" + name +
+                                                "' from " + enclosing.name + " (line " + to_string(enclosing.symbols[slot].line) + ")"});
+            } else if (symbol.name < result.builtinCount) {
+                result.shadowedNames.push_back({symbol.line, 0, "'" + name + "' in " + scope.name + " shadows a builtin"});
+            }
+        }
+    }
+
+    auto byLine = [](const Diagnostic& a, const Diagnostic& b) { return a.line < b.line; };
+    stable_sort(result.undefinedNames.begin(), result.undefinedNames.end(), byLine);
+    stable_sort(result.shadowedNames.begin(), result.shadowedNames.end(), byLine);
+    return result;
+}
+
+// Local type inference over the scopes above. Every binding site becomes an
+// equation "symbol >= type(expression)"; a worklist re-evaluates only the
+// equations that read a symbol whose type just grew. Types form a lattice
+// with Unknown at the bottom, Mixed at the top and the numeric tower
+// bool < int < float in between, so each symbol changes at most four times
+// and the whole pass is linear in the number of equations and name uses.
+enum class InferredType : unsigned char { Unknown, Bool, Int, Float, Str, List, Tuple, Dict, None, Mixed };
+
+const char* inferredTypeName(InferredType type) {
+    static const char* names[] = {"N/A", "bool", "int", "float", "string", "list", "tuple", "dict", "None", "mixed"};
+    return names[int(type)];
+}
+
+bool isNumericType(InferredType type) {
+    return type == InferredType::Bool || type == InferredType::Int || type == InferredType::Float;
+}
+
+InferredType joinTypes(InferredType a, InferredType b) {
+    if (a == b || b == InferredType::Unknown) return a;
+    if (a == InferredType::Unknown) return b;
+    if (isNumericType(a) && isNumericType(b)) return max(a, b);
+    return InferredType::Mixed;
+}
+
+// Result type of a binary operator; Unknown until both operands are known
+InferredType binaryResultType(InferredType left, const string& op, InferredType right) {
+    if (left == InferredType::Unknown || right == InferredType::Unknown) return InferredType::Unknown;
+    if (isNumericType(left) && isNumericType(right)) {
+        if (op == "/") return InferredType::Float;
+        if (op == "&" || op == "|" || op == "^")
+            return left == InferredType::Bool && right == InferredType::Bool ? InferredType::Bool : InferredType::Int;
+        if (op == "<<" || op == ">>") return InferredType::Int;
+        return max(InferredType::Int, max(left, right));
+    }
+    bool sequenceLeft = left == InferredType::Str || left == InferredType::List || left == InferredType::Tuple;
+    bool sequenceRight = right == InferredType::Str || right == InferredType::List || right == InferredType::Tuple;
+    bool intLeft = left == InferredType::Int || left == InferredType::Bool;
+    bool intRight = right == InferredType::Int || right == InferredType::Bool;
+    if (op == "+" && left == right && sequenceLeft) return left;
+    if (op == "*" && sequenceLeft && intRight) return left;
+    if (op == "*" && intLeft && sequenceRight) return right;
+    if (op == "%" && left == InferredType::Str) return InferredType::Str;
+    return InferredType::Mixed;
+}
+
+struct TypeInference {
+    vector<vector<InferredType>> symbolTypes;  // [scope][slot]
+    vector<vector<int>> definedScope;          // [scope][slot]: scope a def/class opens, or -1
+    vector<InferredType> returnTypes;          // [scope], for function scopes
+};
+
+TypeInference inferTypes(const shared_ptr<ParseNode>& root, const SemanticResult& semantics) {
+    const vector<Scope>& scopes = semantics.scopes;
+    TypeInference result;
+    result.returnTypes.assign(scopes.size(), InferredType::Unknown);
+    vector<size_t> firstKey(scopes.size() + 1, 0);  // symbols flattened to one key space
+    for (size_t s = 0; s < scopes.size(); ++s) {
+        result.symbolTypes.emplace_back(scopes[s].symbols.size(), InferredType::Unknown);
+        result.definedScope.emplace_back(scopes[s].symbols.size(), -1);
+        firstKey[s + 1] = firstKey[s] + scopes[s].symbols.size();
+    }
+    if (!root) return result;
+
+    // Where each NAME occurrence lives: (scope, slot) of its binding
+    unordered_map<const ParseNode*, pair<int, int>> symbolOf;
+    auto ownerAtDepth = [&](int scope, int depth) {
+        while (scopes[scope].depth > depth) scope = scopes[scope].parent;
+        return scope;
+    };
+    for (const NameRef& ref : semantics.bindings) symbolOf[ref.node] = {ref.scope, ref.slot};
+    for (const NameRef& ref : semantics.refs)
+        if (ref.depth >= 0) symbolOf[ref.node] = {ownerAtDepth(ref.scope, ref.depth), ref.slot};
+
+    auto targetOf = [&](const ParseNode* name) -> pair<int, int> {
+        auto it = symbolOf.find(name);
+        return it == symbolOf.end() ? pair<int, int>{-1, -1} : it->second;
+    };
+
+    // Scopes by their def/class node, and by the symbol their name binds
+    unordered_map<const ParseNode*, int> scopeOfNode;
+    map<pair<int, int>, int> functionScopeOf;
+    for (size_t s = 1; s < scopes.size(); ++s) {
+        scopeOfNode[scopes[s].node] = int(s);
+        if (scopes[s].node->children.empty()) continue;
+        auto [owner, slot] = targetOf(scopes[s].node->children[0].get());
+        if (owner < 0) continue;
+        result.definedScope[owner][slot] = int(s);
+        if (scopes[s].kind == ScopeKind::Function) functionScopeOf[{owner, slot}] = int(s);
+    }
+
+    enum class EquationKind { Assign, AugAssign, LoopVariable, Argument, Return };
+    struct Equation {
+        EquationKind kind;
+        int scope;                 // target symbol, or the function for Return
+        int slot;
+        const ParseNode* value;    // nullptr: a bare return
+        string op;                 // operator of an augmented assignment
+    };
+    vector<Equation> equations;
+    vector<char> hasReturn(scopes.size(), 0);
+
+    // Collect equations; the stack carries the enclosing function scope
+    vector<pair<const ParseNode*, int>> pending = {{root.get(), -1}};
+    while (!pending.empty()) {
+        auto [node, function] = pending.back();
+        pending.pop_back();
+        const auto& children = node->children;
+        if (node->type == "func_def" && scopeOfNode.count(node)) function = scopeOfNode[node];
+        else if (node->type == "class_def") function = -1;
+
+        if (node->type == "assignment" && children.size() == 3 && children[0] && children[1] && children[2]) {
+            bool augmented = children[1]->value != "=";
+            bool single = children[0]->children.size() == 1;
+            for (const auto& target : children[0]->children) {
+                auto [scope, slot] = targetOf(target.get());
+                if (scope < 0) continue;
+                string op = augmented ? children[1]->value.substr(0, children[1]->value.size() - 1) : "";
+                equations.push_back({augmented ? EquationKind::AugAssign : EquationKind::Assign, scope, slot,
+                                     single ? children[2].get() : nullptr, op});
+            }
+        } else if (node->type == "for_loop" && children.size() > 1 && children[0] && children[1]) {
+            auto [scope, slot] = targetOf(children[0].get());
+            if (scope >= 0) equations.push_back({EquationKind::LoopVariable, scope, slot, children[1].get(), ""});
+        } else if (node->type == "return_stmt" && function >= 0) {
+            hasReturn[function] = 1;
+            equations.push_back({EquationKind::Return, function, -1, children.empty() ? nullptr : children[0].get(), ""});
+        } else if (node->type == "invocation" && children.size() > 2 && children[0] && children[0]->type == "NAME" &&
+                   children[2] && children[2]->type == "arguments") {
+            // f(a, b) with f a known def: each argument flows into its parameter
+            auto callee = functionScopeOf.find(targetOf(children[0].get()));
+            if (callee != functionScopeOf.end()) {
+                const Scope& function = scopes[callee->second];
+                const auto& args = children[2]->children;
+                for (size_t i = 0; i < args.size() && i < function.symbols.size() &&
+                                   function.symbols[i].kind == BindingKind::Parameter; ++i)
+                    if (args[i]) equations.push_back({EquationKind::Argument, callee->second, int(i), args[i].get(), ""});
+            }
+        }
+
+        for (size_t i = children.size(); i-- > 0;)
+            if (children[i]) pending.push_back({children[i].get(), function});
+    }
+
+    // Type of an expression under the current symbol types (post-order,
+    // explicit stack). Calls can't appear inside expressions in this grammar.
+    auto typeOf = [&](const ParseNode* expr) {
+        vector<pair<const ParseNode*, bool>> work = {{expr, false}};
+        vector<InferredType> values;
+        while (!work.empty()) {
+            auto [node, expanded] = work.back();
+            work.pop_back();
+            const string& type = node->type;
+            const auto& children = node->children;
+            bool compound = type.empty() || type == "exprs" || type == "grouped" || type == "expr_list" ||
+                            type == "and" || type == "or" || ((type == "-" || type == "+") && children.size() == 1);
+            if (compound && !expanded) {
+                work.push_back({node, true});
+                for (size_t i = children.size(); i-- > 0;)
+                    if (children[i]) work.push_back({children[i].get(), false});
+                continue;
+            }
+
+            size_t count = 0;
+            for (const auto& child : children) count += child != nullptr;
+            InferredType value = InferredType::Unknown;
+            if (compound) {
+                vector<InferredType> operands(values.end() - count, values.end());
+                values.resize(values.size() - count);
+                if ((type.empty() || type == "exprs") && operands.size() == 3 && children[1])
+                    value = binaryResultType(operands[0], children[1]->type, operands[2]);
+                else if (type == "exprs" || type == "grouped")
+                    value = operands.size() == 1 ? operands[0] : type == "grouped" ? InferredType::Tuple : InferredType::Unknown;
+                else if (type == "expr_list")
+                    value = operands.size() == 1 ? operands[0] : InferredType::Tuple;
+                else if (type == "and" || type == "or")
+                    value = operands.size() == 2 ? joinTypes(operands[0], operands[1]) : InferredType::Unknown;
+                else if (operands.size() == 1)  // unary + / -
+                    value = !isNumericType(operands[0]) ? (operands[0] == InferredType::Unknown ? operands[0] : InferredType::Mixed)
+                          : max(InferredType::Int, operands[0]);
+            } else if (type == "NUMBER") {
+                value = node->value.find('.') != string::npos ? InferredType::Float : InferredType::Int;
+            } else if (type == "STRING") {
+                value = InferredType::Str;
+            } else if (type == "BOOL" || type == "True" || type == "False" || type == "not" ||
+                       type == "comparison_chain" || (findBinaryOperator(type) && findBinaryOperator(type)->precedence ==
+                                                      findBinaryOperator("==")->precedence)) {
+                value = InferredType::Bool;
+            } else if (type == "None") {
+                value = InferredType::None;
+            } else if (type == "list") {
+                value = InferredType::List;
+            } else if (type == "dict") {
+                value = InferredType::Dict;
+            } else if (type == "~") {
+                value = InferredType::Int;
+            } else if (type == "NAME") {
+                auto [scope, slot] = targetOf(node);
+                value = scope >= 0 ? result.symbolTypes[scope][slot] : InferredType::Unknown;
+            }
+            values.push_back(value);
+        }
+        return values.empty() ? InferredType::Unknown : values.back();
+    };
+
+    // What an equation currently says about its target
+    auto evaluate = [&](const Equation& eq) {
+        switch (eq.kind) {
+        case EquationKind::Assign:
+        case EquationKind::Argument:
+            return eq.value ? typeOf(eq.value) : InferredType::Mixed;
+        case EquationKind::AugAssign:
+            return eq.value ? binaryResultType(result.symbolTypes[eq.scope][eq.slot], eq.op, typeOf(eq.value))
+                            : InferredType::Mixed;
+        case EquationKind::LoopVariable: {
+            // Elements of a literal list or tuple are known, other iterables aren't
+            if (eq.value->type == "list" || eq.value->type == "grouped") {
+                InferredType element = InferredType::Unknown;
+                for (const auto& elements : eq.value->children)
+                    if (elements)
+                        for (const auto& item : elements->children)
+                            if (item) element = joinTypes(element, typeOf(item.get()));
+                return element;
+            }
+            InferredType iterable = typeOf(eq.value);
+            return iterable == InferredType::Str || iterable == InferredType::Unknown ? iterable : InferredType::Mixed;
+        }
+        case EquationKind::Return:
+            return eq.value ? typeOf(eq.value) : InferredType::None;
+        }
+        return InferredType::Unknown;
+    };
+
+    // Equations to revisit when a symbol's type grows
+    vector<vector<int>> readers(firstKey.back());
+    for (size_t e = 0; e < equations.size(); ++e) {
+        const Equation& eq = equations[e];
+        if (eq.kind == EquationKind::AugAssign) readers[firstKey[eq.scope] + eq.slot].push_back(int(e));
+        vector<const ParseNode*> walk;
+        if (eq.value) walk.push_back(eq.value);
+        while (!walk.empty()) {
+            const ParseNode* node = walk.back();
+            walk.pop_back();
+            if (node->type == "NAME") {
+                auto [scope, slot] = targetOf(node);
+                if (scope >= 0) readers[firstKey[scope] + slot].push_back(int(e));
+            }
+            for (const auto& child : node->children)
+                if (child) walk.push_back(child.get());
+        }
+    }
+
+    vector<int> worklist(equations.size());
+    vector<char> queued(equations.size(), 1);
+    for (size_t e = 0; e < equations.size(); ++e) worklist[e] = int(equations.size() - 1 - e);
+    while (!worklist.empty()) {
+        const Equation& eq = equations[worklist.back()];
+        queued[worklist.back()] = 0;
+        worklist.pop_back();
+        InferredType& target = eq.slot < 0 ? result.returnTypes[eq.scope] : result.symbolTypes[eq.scope][eq.slot];
+        InferredType joined = joinTypes(target, evaluate(eq));
+        if (joined == target) continue;
+        target = joined;
+        if (eq.slot < 0) continue;  // nothing reads a return type yet
+        for (int reader : readers[firstKey[eq.scope] + eq.slot]) {
+            if (!queued[reader]) {
+                queued[reader] = 1;
+                worklist.push_back(reader);
+            }
+        }
+    }
+
+    // Functions without a return statement return None
+    for (size_t s = 0; s < scopes.size(); ++s)
+        if (scopes[s].kind == ScopeKind::Function && result.returnTypes[s] == InferredType::Unknown &&
+            !hasReturn[s])
+            result.returnTypes[s] = InferredType::None;
+    return result;
+}
+
+// Type shown for a symbol in the symbol tables
+string displayType(const SemanticResult& semantics, const TypeInference& types, int scope, int slot) {
+    const ScopeSymbol& symbol = semantics.scopes[scope].symbols[slot];
+    if (symbol.kind == BindingKind::Import) return "module";
+    if (symbol.kind == BindingKind::Class) return "class";
+    if (symbol.kind == BindingKind::Function) {
+        int function = types.definedScope[scope][slot];
+        return function >= 0 && types.returnTypes[function] != InferredType::Unknown
+             ? string("function -> ") + inferredTypeName(types.returnTypes[function]) : string("function");
+    }
+    return inferredTypeName(types.symbolTypes[scope][slot]);
+}
+
+// Inferred type per name for the flat symbol tables: a module-level binding
+// wins, otherwise the first scope that binds the name
+map<string, string> inferredTypesByName(const SemanticResult& semantics, const TypeInference& types) {
+    map<string, string> byName;
+    for (size_t s = 0; s < semantics.scopes.size(); ++s) {
+        const Scope& scope = semantics.scopes[s];
+        for (size_t slot = 0; slot < scope.symbols.size(); ++slot)
+            byName.emplace(semantics.names.name(scope.symbols[slot].name), displayType(semantics, types, int(s), int(slot)));
+    }
+    return byName;
+}
+
+// Dead code: statements after a return, break or continue in the same
+// block (or after an if whose every branch leaves it), branches whose
+// condition folds to a constant false and those after one that folds to
+// true, loop bodies that never run, and functions nothing outside their own
+// body refers to. Two walks over the statements and one over the resolved
+// names, so the pass is linear in the size of the tree and builds no
+// control-flow graph. Dead statements are kept so later passes can skip them.
+
+// Value of a constant expression. Bools are the numbers 0 and 1, as in
+// Python; Unknown is anything that can't be folded.
+struct ConstantValue {
+    enum Kind { Unknown, Number, Bool, NoneValue, Str } kind = Unknown;
+    double number = 0;
+    bool integer = false;
+    string text;
+
+    bool known() const { return kind != Unknown; }
+    bool truthy() const { return kind == Str ? !text.empty() : kind != NoneValue && number != 0; }
+};
+
+// Fold a literal or a NUMBER/STRING/NAME token's text; nameValue supplies
+// names bound to constants
+ConstantValue constantLeaf(const ParseNode* node, const function<ConstantValue(const ParseNode*)>& nameValue) {
+    ConstantValue value;
+    const string& type = node->type;
+    if (type == "True" || type == "False" || type == "BOOL") {
+        value.kind = ConstantValue::Bool;
+        value.number = (type == "True" || (type == "BOOL" && node->value == "True")) ? 1 : 0;
+        value.integer = true;
+    } else if (type == "None") {
+        value.kind = ConstantValue::NoneValue;
+    } else if (type == "NUMBER") {
+        char* end = nullptr;
+        errno = 0;
+        double number = strtod(node->value.c_str(), &end);
+        if (end != node->value.c_str() && *end == '\0' && errno == 0 && isfinite(number)) {
+            value.kind = ConstantValue::Number;
+            value.number = number;
+            value.integer = node->value.find_first_of(".eE") == string::npos;
+        }
+    } else if (type == "STRING") {
+        // Plain quoted text only; escapes would need decoding to compare
+        const string& text = node->value;
+        size_t quote = text.size() >= 6 && (text.compare(0, 3, "'''") == 0 || text.compare(0, 3, "\"\"\"") == 0) ? 3 : 1;
+        if (text.size() >= 2 * quote && (text[0] == '\'' || text[0] == '"') &&
+            text.compare(text.size() - quote, quote, text, 0, quote) == 0 && text.find('\\') == string::npos) {
+            value.kind = ConstantValue::Str;
+            value.text = text.substr(quote, text.size() - 2 * quote);
+        }
+    } else if (type == "NAME") {
+        value = nameValue(node);
+    }
+    return value;
+}
+
+// Apply a unary or binary operator to folded operands, Unknown when Python
+// would raise or the result isn't exactly representable
+ConstantValue foldOperator(const string& op, const ConstantValue& left, const ConstantValue* right) {
+    ConstantValue result;
+    auto numeric = [](const ConstantValue& v) { return v.kind == ConstantValue::Number || v.kind == ConstantValue::Bool; };
+    auto number = [&](double n, bool integer) {
+        if (!isfinite(n) || (integer && fabs(n) > 9007199254740992.0)) return;
+        result.kind = ConstantValue::Number;
+        result.number = n;
+        result.integer = integer;
+    };
+    auto boolean = [&](bool b) {
+        result.kind = ConstantValue::Bool;
+        result.number = b;
+        result.integer = true;
+    };
+
+    if (!right) {
+        if (op == "not" && left.known()) boolean(!left.truthy());
+        else if (op == "-" && numeric(left)) number(-left.number, left.integer);
+        else if (op == "+" && numeric(left)) number(left.number, left.integer);
+        else if (op == "~" && numeric(left) && left.integer) number(-left.number - 1, true);
+        return result;
+    }
+    if (op == "and") return !left.known() ? result : left.truthy() ? *right : left;
+    if (op == "or") return !left.known() ? result : left.truthy() ? left : *right;
+    if (!left.known() || !right->known()) return result;
+
+    const ConstantValue& r = *right;
+    if (op == "==" || op == "!=") {
+        bool equal = numeric(left) && numeric(r) ? left.number == r.number
+                   : left.kind == r.kind && (left.kind != ConstantValue::Str || left.text == r.text);
+        boolean(equal == (op == "=="));
+    } else if (op == "<" || op == "<=" || op == ">" || op == ">=") {
+        int order;
+        if (numeric(left) && numeric(r)) order = left.number < r.number ? -1 : left.number > r.number;
+        else if (left.kind == ConstantValue::Str && r.kind == ConstantValue::Str) order = left.text.compare(r.text);
+        else return result;
+        boolean(op == "<" ? order < 0 : op == "<=" ? order <= 0 : op == ">" ? order > 0 : order >= 0);
+    } else if (op == "+" && left.kind == ConstantValue::Str && r.kind == ConstantValue::Str) {
+        result.kind = ConstantValue::Str;
+        result.text = left.text + r.text;
+    } else if (numeric(left) && numeric(r)) {
+        double a = left.number, b = r.number;
+        bool integers = left.integer && r.integer;
+        if (op == "+") number(a + b, integers);
+        else if (op == "-") number(a - b, integers);
+        else if (op == "*") number(a * b, integers);
+        else if (op == "/" && b != 0) number(a / b, false);
+        else if (op == "//" && b != 0) number(floor(a / b), integers);
+        else if (op == "%" && b != 0) number(a - b * floor(a / b), integers);
+        else if (op == "**" && !(a == 0 && b < 0)) number(pow(a, b), integers && b >= 0);
+        else if (integers && (op == "&" || op == "|" || op == "^")) {
+            int64_t x = int64_t(a), y = int64_t(b);
+            number(double(op == "&" ? x & y : op == "|" ? x | y : x ^ y), true);
+        } else if (integers && (op == "<<" || op == ">>") && b >= 0 && b < 53) {
+            int64_t x = int64_t(a);
+            number(op == "<<" ? a * pow(2.0, b) : double(x >> int(b)), true);
+        }
+    }
+    return result;
+}
+
+// Fold an expression tree bottom-up with an explicit stack
+ConstantValue foldConstant(const ParseNode* root, const function<ConstantValue(const ParseNode*)>& nameValue) {
+    // Arithmetic ("" [a, op, b], or exprs when it is the whole right-hand
+    // side) and comparison chains keep their operators as children; only
+    // the operands are folded
+    auto arithmetic = [](const ParseNode* node) {
+        return (node->type.empty() || node->type == "exprs") && node->children.size() == 3 && node->children[1];
+    };
+    auto operandCount = [&](const ParseNode* node) {
+        return node->type == "comparison_chain" ? (node->children.size() + 1) / 2
+             : arithmetic(node) ? size_t(2) : node->children.size();
+    };
+    auto operand = [&](const ParseNode* node, size_t k) {
+        return node->type == "comparison_chain" || arithmetic(node) ? node->children[2 * k].get()
+                                                                    : node->children[k].get();
+    };
+    auto compound = [&](const ParseNode* node) {
+        const string& type = node->type;
+        if (arithmetic(node)) return true;
+        if (type == "comparison_chain") return node->children.size() >= 3 && node->children.size() % 2 == 1;
+        if (type == "exprs" || type == "grouped" || type == "expr_list") return node->children.size() == 1;
+        return findBinaryOperator(type) ? node->children.size() == 2
+             : (type == "not" || type == "-" || type == "+" || type == "~") && node->children.size() == 1;
+    };
+
+    vector<ConstantValue> values;
+    vector<pair<const ParseNode*, bool>> pending;
+    if (root) pending.push_back({root, false});
+    while (!pending.empty()) {
+        auto [node, expanded] = pending.back();
+        pending.pop_back();
+        if (!expanded && compound(node)) {
+            size_t count = operandCount(node);
+            bool complete = true;
+            for (size_t k = 0; k < count; ++k) complete = complete && operand(node, k);
+            if (complete) {
+                pending.push_back({node, true});
+                for (size_t k = count; k-- > 0;) pending.push_back({operand(node, k), false});
+                continue;
+            }
+            values.push_back(ConstantValue());
+            continue;
+        }
+        if (!expanded) {
+            values.push_back(node->children.empty() ? constantLeaf(node, nameValue) : ConstantValue());
+            continue;
+        }
+
+        size_t count = operandCount(node);
+        vector<ConstantValue> operands(make_move_iterator(values.end() - count), make_move_iterator(values.end()));
+        values.resize(values.size() - count);
+        const string& type = node->type;
+        ConstantValue value;
+        if (arithmetic(node)) {
+            value = foldOperator(node->children[1]->type, operands[0], &operands[1]);
+        } else if (type == "exprs" || type == "grouped" || type == "expr_list") {
+            value = move(operands[0]);
+        } else if (type == "comparison_chain") {
+            // a < b <= c is a < b and b <= c
+            for (size_t k = 0; k + 1 < operands.size(); ++k) {
+                value = foldOperator(node->children[2 * k + 1]->type, operands[k], &operands[k + 1]);
+                if (!value.known() || !value.truthy()) break;
+            }
+        } else {
+            value = foldOperator(type, operands[0], operands.size() > 1 ? &operands[1] : nullptr);
+        }
+        values.push_back(move(value));
+    }
+    return values.empty() ? ConstantValue() : values.back();
+}
+
+struct DeadCodeResult {
+    vector<Diagnostic> findings;               // by line
+    unordered_set<const ParseNode*> dead;      // statements, small statements and suites that never run, unused functions
+
+    bool isDead(const ParseNode* node) const { return dead.count(node) != 0; }
+};
+
+DeadCodeResult findDeadCode(const shared_ptr<ParseNode>& root, const SemanticResult& semantics) {
+    DeadCodeResult result;
+    if (!root) return result;
+
+    // Where each name occurrence resolved: (scope, slot) of its binding
+    auto ownerOf = [&](int scope, int depth) {
+        while (scope >= 0 && semantics.scopes[scope].depth != depth) scope = semantics.scopes[scope].parent;
+        return scope;
+    };
+    unordered_map<const ParseNode*, pair<int, int>> bindingOf, useOf;
+    vector<vector<int>> bindingCounts(semantics.scopes.size());
+    for (size_t s = 0; s < semantics.scopes.size(); ++s) bindingCounts[s].resize(semantics.scopes[s].symbols.size());
+    for (const NameRef& binding : semantics.bindings) {
+        bindingOf[binding.node] = {binding.scope, binding.slot};
+        ++bindingCounts[binding.scope][binding.slot];
+    }
+    for (const NameRef& ref : semantics.refs)
+        if (ref.depth >= 0) useOf[ref.node] = {ownerOf(ref.scope, ref.depth), ref.slot};
+
+    // Names bound exactly once, by name = <constant>, fold to that constant
+    map<pair<int, int>, ConstantValue> constants;
+    auto nameValue = [&](const ParseNode* name) {
+        auto use = useOf.find(name);
+        if (use == useOf.end()) return ConstantValue();
+        auto constant = constants.find(use->second);
+        return constant == constants.end() ? ConstantValue() : constant->second;
+    };
+    auto isStatementList = [](const ParseNode* node) { return node->type == "stmt_list" || node->type == "suite"; };
+    // After a syntax error the statements of a block aren't the ones written
+    auto hasErrors = [](const ParseNode* list) {
+        return any_of(list->children.begin(), list->children.end(),
+                      [](const shared_ptr<ParseNode>& statement) { return statement && statement->type == "error"; });
+    };
+
+    // Walk 1, children before parents: record constants, fold every
+    // condition, and work out which statements never fall through to the
+    // next one (the exit is the keyword that leaves, or "if" when every
+    // branch of a conditional does)
+    unordered_map<const ParseNode*, ConstantValue> conditions;
+    unordered_map<const ParseNode*, const char*> exits;
+    bool syntaxErrors = false;
+    auto exitOf = [&](const ParseNode* node) {
+        auto exit = node ? exits.find(node) : exits.end();
+        return exit == exits.end() ? nullptr : exit->second;
+    };
+    // Statements and suites right below node (expressions hold neither)
+    auto blocksIn = [&](const ParseNode* node, vector<const ParseNode*>& out) {
+        const string& type = node->type;
+        const auto& children = node->children;
+        if (isStatementList(node) || type == "program") {
+            for (const auto& child : children)
+                if (child) out.push_back(child.get());
+        } else if (type == "if_chain") {
+            for (size_t k = 1; k < children.size(); k += 2)
+                if (children[k]) out.push_back(children[k].get());
+        } else if (type == "conditional" || type == "while_loop" || type == "for_loop" || type == "func_def" ||
+                   type == "class_def" || type == "error") {
+            // A body on the header's line is a simple_stmts, not a suite
+            for (const auto& child : children)
+                if (child && (child->type == "suite" || child->type == "if_chain" || child->type == "simple_stmts"))
+                    out.push_back(child.get());
+        }
+    };
+
+    vector<pair<const ParseNode*, bool>> pending = {{root.get(), false}};
+    vector<const ParseNode*> below;
+    while (!pending.empty()) {
+        auto [node, expanded] = pending.back();
+        pending.pop_back();
+        if (!expanded) {
+            pending.push_back({node, true});
+            below.clear();
+            blocksIn(node, below);
+            for (auto child = below.rbegin(); child != below.rend(); ++child) pending.push_back({*child, false});
+            continue;
+        }
+
+        const auto& children = node->children;
+        syntaxErrors = syntaxErrors || node->type == "error";
+        if (node->type == "simple_stmts") {
+            for (const auto& small : children) {
+                if (!small) continue;
+                if (small->type == "return_stmt") exits[node] = "return";
+                else if (small->type == "break_stmt") exits[node] = "break";
+                else if (small->type == "continue_stmt") exits[node] = "continue";
+                else if (small->type == "assignment" && small->children.size() == 3 && small->children[0] &&
+                         small->children[0]->children.size() == 1 && small->children[1] && small->children[1]->value == "=") {
+                    auto binding = bindingOf.find(small->children[0]->children[0].get());
+                    if (binding == bindingOf.end()) continue;
+                    auto [scope, slot] = binding->second;
+                    if (bindingCounts[scope][slot] != 1) continue;
+                    ConstantValue value = foldConstant(small->children[2].get(), nameValue);
+                    if (value.known()) constants[binding->second] = move(value);
+                }
+                if (exits.count(node)) break;
+            }
+        } else if (isStatementList(node) && !hasErrors(node)) {
+            for (const auto& statement : children)
+                if (const char* exit = exitOf(statement.get())) {
+                    exits[node] = exit;
+                    break;
+                }
+        } else if (node->type == "while_loop" && !children.empty() && children[0]) {
+            conditions[node] = foldConstant(children[0].get(), nameValue);
+        } else if (node->type == "conditional" && !children.empty() && children[0] && children[0]->type == "if_chain") {
+            // Leaves the block when every branch that can run does: those up
+            // to the first always-true condition, else all of them and else
+            const auto& chain = children[0]->children;
+            bool allExit = true, decided = false;
+            for (size_t k = 0; k + 1 < chain.size(); k += 2) {
+                if (!chain[k]) continue;
+                ConstantValue condition = foldConstant(chain[k].get(), nameValue);
+                conditions[chain[k].get()] = condition;
+                if (condition.known() && !condition.truthy()) continue;
+                allExit = allExit && exitOf(chain[k + 1].get());
+                if (condition.known()) {
+                    decided = true;
+                    break;
+                }
+            }
+            if (!decided) allExit = allExit && children.size() > 1 && exitOf(children[1].get());
+            if (allExit) exits[node] = "if";
+        }
+    }
+
+    // Walk 2, parents first, never entering dead code: report it
+    auto firstLine = [](const ParseNode* node) {
+        while (node && node->line < 0 && !node->children.empty()) node = node->children[0].get();
+        return node ? node->line : -1;
+    };
+    // A finding on node's first line, covering node's bytes
+    auto finding = [&](const ParseNode* node, const string& message) {
+        return Diagnostic{firstLine(node), 0, message, node->begin, node->end - node->begin};
+    };
+    auto markDead = [&](const ParseNode* node, const string& message) {
+        result.dead.insert(node);
+        const ParseNode* first = isStatementList(node) && !node->children.empty() ? node->children[0].get() : node;
+        result.findings.push_back(finding(first, message));
+    };
+    auto afterExit = [](const char* exit) {
+        return strcmp(exit, "if") == 0 ? string("unreachable code: every branch of the if above leaves the block")
+                                       : "unreachable code after '" + string(exit) + "'";
+    };
+    vector<const ParseNode*> liveFunctions;  // outside dead code and broken statements
+    vector<pair<const ParseNode*, bool>> stack = {{root.get(), false}};
+    while (!stack.empty()) {
+        auto [node, broken] = stack.back();
+        stack.pop_back();
+        const auto& children = node->children;
+        below.clear();
+
+        if (isStatementList(node) && !hasErrors(node)) {
+            const char* exit = nullptr;  // what left the block, once something has
+            bool reported = false;
+            for (const auto& statement : children) {
+                if (!statement) continue;
+                if (!exit) {
+                    below.push_back(statement.get());
+                    exit = exitOf(statement.get());
+                    continue;
+                }
+                result.dead.insert(statement.get());
+                if (!reported) result.findings.push_back(finding(statement.get(), afterExit(exit)));
+                reported = true;
+            }
+        } else if (node->type == "simple_stmts") {
+            bool exited = false;
+            for (const auto& small : children) {
+                if (!small) continue;
+                if (exited) {
+                    result.dead.insert(small.get());
+                    continue;
+                }
+                exited = small->type == "return_stmt" || small->type == "break_stmt" || small->type == "continue_stmt";
+                if (exited && &small != &children.back())
+                    result.findings.push_back(finding(node, afterExit(small->type == "return_stmt" ? "return"
+                                                                      : small->type == "break_stmt" ? "break" : "continue")));
+            }
+        } else if (node->type == "while_loop" && children.size() > 1) {
+            const ConstantValue& condition = conditions[node];
+            if (condition.known() && !condition.truthy() && children[1])
+                markDead(children[1].get(), "loop body never runs: its condition is always false");
+            else if (children[1])
+                below.push_back(children[1].get());
+        } else if (node->type == "conditional" && !children.empty() && children[0] && children[0]->type == "if_chain") {
+            const auto& chain = children[0]->children;
+            bool taken = false;  // an earlier condition is always true
+            for (size_t k = 0; k + 1 < chain.size(); k += 2) {
+                if (!chain[k + 1]) continue;
+                auto condition = conditions.find(chain[k].get());
+                bool alwaysFalse = condition != conditions.end() && condition->second.known() && !condition->second.truthy();
+                if (taken) markDead(chain[k + 1].get(), "branch never runs: an earlier condition is always true");
+                else if (alwaysFalse) markDead(chain[k + 1].get(), "branch never runs: its condition is always false");
+                else below.push_back(chain[k + 1].get());
+                if (condition != conditions.end() && condition->second.known() && condition->second.truthy()) taken = true;
+            }
+            if (children.size() > 1 && children[1]) {
+                if (taken) markDead(children[1].get(), "branch never runs: an earlier condition is always true");
+                else below.push_back(children[1].get());
+            }
+        } else {
+            if (node->type == "func_def" && !broken) liveFunctions.push_back(node);
+            broken = broken || node->type == "error";
+            blocksIn(node, below);
+        }
+        for (auto child = below.rbegin(); child != below.rend(); ++child) stack.push_back({*child, broken});
+    }
+
+    // Functions that no name outside their own body resolves to; not
+    // methods, which are used through attributes this analysis can't see,
+    // nor __special__ ones, which Python calls itself. A statement that
+    // failed to parse may hold the only use, so then none are reported.
+    vector<vector<char>> used(semantics.scopes.size());
+    for (size_t s = 0; s < semantics.scopes.size(); ++s) used[s].resize(semantics.scopes[s].symbols.size());
+    for (const NameRef& ref : semantics.refs) {
+        if (ref.depth < 0) continue;
+        int owner = ownerOf(ref.scope, ref.depth);
+        if (owner < 0) continue;
+        // A call from inside the function itself (recursion) doesn't count
+        bool inside = false;
+        for (int s = ref.scope; s >= 0 && s != owner && !inside; s = semantics.scopes[s].parent) {
+            const Scope& scope = semantics.scopes[s];
+            if (scope.parent != owner || scope.kind != ScopeKind::Function || !scope.node || scope.node->children.empty())
+                continue;
+            auto binding = bindingOf.find(scope.node->children[0].get());
+            inside = binding != bindingOf.end() && binding->second == make_pair(owner, ref.slot);
+        }
+        if (!inside) used[owner][ref.slot] = 1;
+    }
+    if (syntaxErrors) liveFunctions.clear();
+    for (const ParseNode* function : liveFunctions) {
+        if (function->children.empty() || !function->children[0]) continue;
+        auto binding = bindingOf.find(function->children[0].get());
+        if (binding == bindingOf.end()) continue;
+        auto [scope, slot] = binding->second;
+        const string& name = function->children[0]->value;
+        bool special = name.size() > 4 && name.compare(0, 2, "__") == 0 && name.compare(name.size() - 2, 2, "__") == 0;
+        if (semantics.scopes[scope].kind == ScopeKind::Class || special || used[scope][slot]) continue;
+        result.dead.insert(function);
+        result.findings.push_back(finding(function->children[0].get(), "function '" + name + "' is never used"));
+    }
+
+    stable_sort(result.findings.begin(), result.findings.end(),
+                [](const Diagnostic& a, const Diagnostic& b) { return a.line < b.line; });
+    return result;
+}
+
 class LexerAnalyzerWindow : public QMainWindow {
     Q_OBJECT
 
@@ -1681,6 +3446,13 @@ public:
         identifiersText->setStyleSheet("background-color: #2d2d2d; color: #ffffff; border: none; font-family: 'Courier New';");
         QVBoxLayout *identifiersLayout = new QVBoxLayout(identifiersTab);
         identifiersLayout->addWidget(identifiersText);
+        errorsTab = new QWidget();
+        errorsList = new QListWidget(errorsTab);
+        errorsList->setObjectName("errorsList");
+        errorsList->setStyleSheet("background-color: #2d2d2d; color: #ffffff; border: none; font-family: 'Courier New';");
+        QVBoxLayout *errorsLayout = new QVBoxLayout(errorsTab);
+        errorsLayout->addWidget(errorsList);
+        connect(errorsList, &QListWidget::itemClicked, this, &LexerAnalyzerWindow::showDiagnostic);
         treeTab = new QWidget();
         treeView = new QGraphicsView(treeTab);
         treeScene = new QGraphicsScene(treeView);
@@ -1714,6 +3486,7 @@ public:
         tabWidget->addTab(tokensTab, "TOKENS");
         tabWidget->addTab(identifiersTab, "IDENTIFIERS");
         tabWidget->addTab(treeTab, "TREE");
+        tabWidget->addTab(errorsTab, "ERRORS");
         resultsLayout->addWidget(resultsLabel);
         resultsLayout->addWidget(tabWidget);
 
@@ -1738,6 +3511,10 @@ public:
         connect(saveButton, &QPushButton::clicked, this, &LexerAnalyzerWindow::saveFile);
         connect(clearButton, &QPushButton::clicked, this, &LexerAnalyzerWindow::clearText);
         connect(analyzeButton, &QPushButton::clicked, this, &LexerAnalyzerWindow::analyzeCode);
+
+        parseTimer = new QTimer(this);
+        parseTimer->setInterval(0);  // whenever the event loop is idle
+        connect(parseTimer, &QTimer::timeout, this, &LexerAnalyzerWindow::parseSlice);
         connect(themeButton, &QPushButton::clicked, this, &LexerAnalyzerWindow::toggleTheme);
 
         applyTheme();
@@ -1825,14 +3602,27 @@ private slots:
     }
 
     void clearText() {
+        cancelAnalysis();
         codeEditor->clear();
         tokensText->clear();
         identifiersText->clear();
+        errorsList->clear();
         outputIndex = 0;
         symbolTable.clear();
     }
 
+    // Select the source a diagnostic points at, or put the cursor there
+    void showDiagnostic(QListWidgetItem* item) {
+        QTextCursor cursor = codeEditor->textCursor();
+        int length = codeEditor->document()->characterCount() - 1;
+        cursor.setPosition(min(item->data(Qt::UserRole).toInt(), length));
+        cursor.setPosition(min(item->data(Qt::UserRole + 1).toInt(), length), QTextCursor::KeepAnchor);
+        codeEditor->setTextCursor(cursor);
+        codeEditor->setFocus();
+    }
+
     void analyzeCode() {
+        cancelAnalysis();
         QApplication::setOverrideCursor(Qt::WaitCursor);
 
         treeScene->clear();
@@ -1840,22 +3630,25 @@ private slots:
         outputIndex = 0;
         tokensText->clear();
         identifiersText->clear();
+        errorsList->clear();
         symbolTable.clear();
+        errorCount = warningCount = 0;
 
         try {
-            QString customTempDir = QDir::tempPath() + "/ParserTemp/";
-            if (!QDir().mkpath(customTempDir)) {
+            analysisDir = QDir::tempPath() + "/ParserTemp/";
+            if (!QDir().mkpath(analysisDir)) {
                 throw runtime_error("Failed to create temporary directory");
             }
 
-            string code = codeEditor->toPlainText().toStdString();
-            QString inputFilePath = customTempDir + "input.py";
+            analyzedCode = codeEditor->toPlainText().toStdString();
+            analyzedLines = LineIndex(analyzedCode);
+            QString inputFilePath = analysisDir + "input.py";
             {
                 ofstream tempFile(inputFilePath.toStdString());
                 if (!tempFile) {
                     throw runtime_error("Failed to create temporary input file");
                 }
-                tempFile << code;
+                tempFile << analyzedCode;
             }
 
             ifstream file(inputFilePath.toStdString());
@@ -1863,7 +3656,9 @@ private slots:
                 throw runtime_error("Failed to open temporary input file");
             }
 
-            ifstream flattened = flatten_multiline_file(file);
+            analyzedMaps.clear();
+            ifstream flattened = flatten_multiline_file(file, &analyzedMaps);
+            vector<string> flattenedLines;  // as lexed, for locating the tokens
             string line;
             int lineNumber = 0;
             stack<char> brackets;
@@ -1872,6 +3667,7 @@ private slots:
 
             while (getline(flattened, line)) {
                 ++lineNumber;
+                flattenedLines.push_back(line);
                 if (isCommentLine(line)) continue;
                 if (line.size() > 0) {
                     storeOutput("\n");
@@ -1884,14 +3680,14 @@ private slots:
             vector<string> sanitized_tokens = sanitize_tokens_vector(tokens);
             saveTokensToFile(sanitized_tokens); // Use sanitized tokens for file and further processing
 
+            // Collect every lexical error; the parser reports syntax errors after it
+            regex error_token(R"(<error;\s*([^>]*)>)");
             for (const string& line : tokens) { // Changed to use non-sanitized 'tokens'
                 size_t openBracket = line.find('[');
                 size_t closeBracket = line.find(']');
-                string numberStr = line.substr(openBracket + 1, closeBracket - openBracket - 1);
-                if (line.find("<error;") != string::npos) {
-                    QMessageBox::information(nullptr, "Error",
-                                             QString("\n Error at line %1: PROGRAM TERMINATED.").arg(numberStr));
-                    return;
+                int lexedLine = atoi(line.substr(openBracket + 1, closeBracket - openBracket - 1).c_str());
+                for (sregex_iterator it(line.begin(), line.end(), error_token), end; it != end; ++it) {
+                    listDiagnostic("Error", Diagnostic{lexedLine, 0, (*it)[1].str()});
                 }
             }
 
@@ -1902,84 +3698,33 @@ private slots:
             }
 
             build_and_draw_symbol_table(sanitized_tokens); // Use sanitized tokens for symbol table
-            string table_html = "<pre><table border='1' style='border-collapse: collapse; font-family: \"Courier New\";'>";
-            table_html += "<tr style='background-color: " + string(isDarkTheme ? "#444444" : "#cccccc") + ";'>";
-            table_html += "<th style='padding: 5px; width: 60px; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>Index</th>";
-            table_html += "<th style='padding: 5px; width: 100px; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>ID</th>";
-            table_html += "<th style='padding: 5px; width: 80px; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>Type</th>";
-            table_html += "<th style='padding: 5px; width: 100px; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>Value</th>";
-            table_html += "</tr>";
-
-            int index = 1;
-            for (const auto& [name, info] : symbolTable) {
-                string type_color;
-                if (info.type == "int") type_color = (isDarkTheme ? "#ffff55" : "#ccaa00");
-                else if (info.type == "float") type_color = (isDarkTheme ? "#55ffff" : "#0088cc");
-                else if (info.type == "string") type_color = (isDarkTheme ? "#ff55ff" : "#cc2200");
-                else type_color = (isDarkTheme ? "#aaaaaa" : "#666666");
-
-                table_html += "<tr style='background-color: " + string(isDarkTheme ? (index % 2 == 0 ? "#333333" : "#3c3c3c") : (index % 2 == 0 ? "#e6e6e6" : "#f0f0f0")) + ";'>";
-                table_html += "<td style='padding: 5px; text-align: center; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>" + to_string(index) + "</td>";
-                table_html += "<td style='padding: 5px; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>" + info.name + "</td>";
-                table_html += "<td style='padding: 5px; color: " + type_color + ";'>" + (info.type.empty() ? "N/A" : info.type) + "</td>";
-                table_html += "<td style='padding: 5px; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>" + (info.type.empty() ? "N/A" : info.value) + "</td></tr>";
-                index++;
-            }
-            table_html += "</table></pre>";
-            identifiersText->setHtml(QString::fromStdString(table_html));
-
-            Parser parser;
-            parser.loadTokens(tokensFilePath.toStdString());
-            shared_ptr<ParseNode> parseTree = parser.parse();
-
-            if (parseTree) {
-                QString dotFilePath = customTempDir + "parse_tree.dot";
-                QString pngFilePath = customTempDir + "parse_tree.png";
-
-                parser.generateDOTFile(parseTree, dotFilePath.toStdString());
-                statusBar()->showMessage("Generated DOT file", 2000);
-
-                QFile inFile(dotFilePath);
-                QString content;
-                if (inFile.open(QIODevice::ReadOnly | QIODevice::Text)) {
-                    content = QString(inFile.readAll());
-                    inFile.close();
-                }
-                QString processed = QString::fromStdString(parser.processDotLabels(content.toStdString()));
-                QFile outFile(dotFilePath);
-                if (outFile.open(QIODevice::WriteOnly | QIODevice::Text)) {
-                    outFile.write(processed.toUtf8());
-                    outFile.close();
-                }
-
-                string errorMsg;
-                if (!parser.create_Tree(dotFilePath.toStdString(), pngFilePath.toStdString())) {
-                    throw runtime_error("Failed to generate parse tree image");
-                }
-
-                QPixmap pixmap(pngFilePath);
-                if (!pixmap.isNull()) {
-                    treeScene->clear();
-                    QGraphicsPixmapItem* pixmapItem = treeScene->addPixmap(pixmap);
-                    treeScene->setBackgroundBrush(QBrush(Qt::white));
-                    treeView->setSceneRect(pixmapItem->boundingRect());
-                    treeView->fitInView(pixmapItem, Qt::KeepAspectRatio);
-                    treeView->scale(0.9, 0.9);
-                    statusBar()->showMessage("Tree visualization loaded", 2000);
-                } else {
-                    throw runtime_error("Failed to load generated image");
-                }
-            }
 
+            // Parsed a slice per timer tick (parseSlice), which finishes the analysis
+            parser = make_unique<Parser>();
+            parser->loadTokens(tokensFilePath.toStdString());
+            parser->locate(flattenedLines, analyzedMaps);
+            parser->beginParse();
+            parseTimer->start();
+            return;
         } catch (const exception& e) {
-            statusBar()->showMessage(QString::fromStdString("Error: " + string(e.what())), 5000);
+            showAnalysisError(e);
+        }
+        QApplication::restoreOverrideCursor();
+    }
 
-            if (string(e.what()).find("Graphviz") != string::npos) {
-                QGraphicsTextItem* errorItem = treeScene->addText(
-                    QString::fromStdString("Graphviz Error:\n" + string(e.what()) +
-                                           "\n\nPlease install Graphviz from\nhttps://graphviz.org/download/"));
-                errorItem->setDefaultTextColor(isDarkTheme ? Qt::white : Qt::black);
-            }
+    // One tick of the parse timer: a frame's worth of statements, then back
+    // to the event loop so the window keeps repainting, until the tree is done
+    void parseSlice() {
+        shared_ptr<ParseNode> parseTree;
+        if (!parser->parseFor(chrono::milliseconds(10), parseTree)) {
+            statusBar()->showMessage(QString("Parsing... %1%").arg(int(parser->parsedFraction() * 100)));
+            return;
+        }
+        parseTimer->stop();
+        try {
+            finishAnalysis(parseTree);
+        } catch (const exception& e) {
+            showAnalysisError(e);
         }
         QApplication::restoreOverrideCursor();
     }
@@ -2001,12 +3746,146 @@ private:
         }
     }
 
+    // Stop a parse still running from an earlier analysis
+    void cancelAnalysis() {
+        if (!parseTimer->isActive()) return;
+        parseTimer->stop();
+        parser.reset();
+        QApplication::restoreOverrideCursor();
+    }
+
+    // Everything after the parse: syntax errors, scopes and types, the
+    // symbol table, warnings and the tree image
+    void finishAnalysis(const shared_ptr<ParseNode>& parseTree) {
+        for (const Diagnostic& d : parser->getDiagnostics()) {
+            listDiagnostic("Syntax error", d);
+        }
+
+        // Scope analysis and type inference; the symbol tab shows the inferred types
+        SemanticResult semantics = analyzeScopes(parseTree);
+        applyInferredTypes(symbolTable, inferredTypesByName(semantics, inferTypes(parseTree, semantics)));
+        DeadCodeResult deadCode = findDeadCode(parseTree, semantics);
+
+        string table_html = "<pre><table border='1' style='border-collapse: collapse; font-family: \"Courier New\";'>";
+        table_html += "<tr style='background-color: " + string(isDarkTheme ? "#444444" : "#cccccc") + ";'>";
+        table_html += "<th style='padding: 5px; width: 60px; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>Index</th>";
+        table_html += "<th style='padding: 5px; width: 100px; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>ID</th>";
+        table_html += "<th style='padding: 5px; width: 80px; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>Type</th>";
+        table_html += "<th style='padding: 5px; width: 100px; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>Value</th>";
+        table_html += "</tr>";
+
+        int index = 1;
+        for (const auto& [name, info] : symbolTable) {
+            string type_color;
+            if (info.type == "int") type_color = (isDarkTheme ? "#ffff55" : "#ccaa00");
+            else if (info.type == "float") type_color = (isDarkTheme ? "#55ffff" : "#0088cc");
+            else if (info.type == "string") type_color = (isDarkTheme ? "#ff55ff" : "#cc2200");
+            else type_color = (isDarkTheme ? "#aaaaaa" : "#666666");
+
+            table_html += "<tr style='background-color: " + string(isDarkTheme ? (index % 2 == 0 ? "#333333" : "#3c3c3c") : (index % 2 == 0 ? "#e6e6e6" : "#f0f0f0")) + ";'>";
+            table_html += "<td style='padding: 5px; text-align: center; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>" + to_string(index) + "</td>";
+            table_html += "<td style='padding: 5px; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>" + info.name + "</td>";
+            table_html += "<td style='padding: 5px; color: " + type_color + ";'>" + (info.type.empty() ? "N/A" : info.type) + "</td>";
+            table_html += "<td style='padding: 5px; color: " + string(isDarkTheme ? "#ffffff" : "#000000") + ";'>" + (info.type.empty() ? "N/A" : info.value) + "</td></tr>";
+            index++;
+        }
+        table_html += "</table></pre>";
+        identifiersText->setHtml(QString::fromStdString(table_html));
+
+        // Undefined names are errors, shadowing only a warning
+        for (const Diagnostic& d : semantics.undefinedNames) {
+            listDiagnostic("Semantic error", d);
+        }
+        for (const Diagnostic& d : semantics.shadowedNames) {
+            listDiagnostic("Warning", d);
+        }
+        for (const Diagnostic& d : deadCode.findings) {
+            listDiagnostic("Warning", d);
+        }
+        if (errorCount > 0 || warningCount > 0) {
+            tabWidget->setCurrentWidget(errorsTab);
+            statusBar()->showMessage(QString("%1 error(s), %2 warning(s) found").arg(errorCount).arg(warningCount));
+        }
+
+        if (parseTree) {
+            QString dotFilePath = analysisDir + "parse_tree.dot";
+            QString pngFilePath = analysisDir + "parse_tree.png";
+
+            parser->generateDOTFile(parseTree, dotFilePath.toStdString());
+            statusBar()->showMessage("Generated DOT file", 2000);
+
+            QFile inFile(dotFilePath);
+            QString content;
+            if (inFile.open(QIODevice::ReadOnly | QIODevice::Text)) {
+                content = QString(inFile.readAll());
+                inFile.close();
+            }
+            QString processed = QString::fromStdString(parser->processDotLabels(content.toStdString()));
+            QFile outFile(dotFilePath);
+            if (outFile.open(QIODevice::WriteOnly | QIODevice::Text)) {
+                outFile.write(processed.toUtf8());
+                outFile.close();
+            }
+
+            string errorMsg;
+            if (!parser->create_Tree(dotFilePath.toStdString(), pngFilePath.toStdString())) {
+                throw runtime_error("Failed to generate parse tree image");
+            }
+
+            QPixmap pixmap(pngFilePath);
+            if (!pixmap.isNull()) {
+                treeScene->clear();
+                QGraphicsPixmapItem* pixmapItem = treeScene->addPixmap(pixmap);
+                treeScene->setBackgroundBrush(QBrush(Qt::white));
+                treeView->setSceneRect(pixmapItem->boundingRect());
+                treeView->fitInView(pixmapItem, Qt::KeepAspectRatio);
+                treeView->scale(0.9, 0.9);
+                statusBar()->showMessage("Tree visualization loaded", 2000);
+            } else {
+                throw runtime_error("Failed to load generated image");
+            }
+        }
+    }
+
+    void showAnalysisError(const exception& e) {
+        statusBar()->showMessage(QString::fromStdString("Error: " + string(e.what())), 5000);
+
+        if (string(e.what()).find("Graphviz") != string::npos) {
+            QGraphicsTextItem* errorItem = treeScene->addText(
+                QString::fromStdString("Graphviz Error:\n" + string(e.what()) +
+                                       "\n\nPlease install Graphviz from\nhttps://graphviz.org/download/"));
+            errorItem->setDefaultTextColor(isDarkTheme ? Qt::white : Qt::black);
+        }
+    }
+
+    // Add d to the error list. Its entry selects the source it covers, or
+    // for one that isn't located (a lexical error), the start of its line.
+    void listDiagnostic(const QString& kind, const Diagnostic& d) {
+        uint32_t offset = d.offset, length = d.length;
+        if (d.length == 0 && d.column == 0) {
+            offset = d.line >= 1 && size_t(d.line) <= analyzedMaps.size() ? analyzedMaps[size_t(d.line) - 1].sourceOffset(0) : 0;
+        }
+        auto [sourceLine, sourceColumn] = analyzedLines.position(offset);
+        QString text = QString("%1 at line %2, column %3: %4")
+                           .arg(kind).arg(sourceLine).arg(sourceColumn).arg(QString::fromStdString(d.message));
+        auto* item = new QListWidgetItem(text, errorsList);
+        // The editor counts UTF-16 units, the offsets count UTF-8 bytes
+        const string& code = analyzedCode;
+        int begin = QString::fromUtf8(code.data(), int(min<size_t>(offset, code.size()))).size();
+        int end = QString::fromUtf8(code.data(), int(min<size_t>(offset + length, code.size()))).size();
+        item->setData(Qt::UserRole, begin);
+        item->setData(Qt::UserRole + 1, end);
+        (kind == "Warning" ? warningCount : errorCount)++;
+    }
+
     QTextEdit *codeEditor;
     QTabWidget *tabWidget;
     QWidget *tokensTab;
     QTextEdit *tokensText;
     QWidget *identifiersTab;
     QTextEdit *identifiersText;
+    QWidget *errorsTab;
+    QListWidget *errorsList;
     QWidget* treeTab;
     QGraphicsView* treeView;
     QGraphicsScene* treeScene;
@@ -2014,6 +3893,16 @@ private:
     PythonSyntaxHighlighter *highlighter;
     bool isDarkTheme;
 
+    // The analysis in progress. The parser works through its tokens a slice
+    // per parseTimer tick; the rest is the source, kept to place diagnostics.
+    QTimer *parseTimer;
+    unique_ptr<Parser> parser;
+    string analyzedCode;
+    vector<SourceMap> analyzedMaps;  // where each lexed line came from in analyzedCode
+    LineIndex analyzedLines;
+    QString analysisDir;
+    int errorCount = 0, warningCount = 0;
+
     const QString darkThemeStylesheet = R"(
         QMainWindow {
             background-color: #2b2b2b;
@@ -2026,7 +3915,7 @@ private:
             font-size: 14px;
             letter-spacing: 3.5px;
         }
-        QTextEdit#tokensText, QTextEdit#identifiersText {
+        QTextEdit#tokensText, QTextEdit#identifiersText, QListWidget#errorsList {
             background-color: #1e1e1e;
             color: #ffffff;
             font-family: "Courier New";
@@ -2073,7 +3962,7 @@ private:
             font-size: 14px;
             letter-spacing: 3.5px;
         }
-        QTextEdit#tokensText, QTextEdit#identifiersText {
+        QTextEdit#tokensText, QTextEdit#identifiersText, QListWidget#errorsList {
             background-color: #f0f0f0;
             color: #000000;
             font-family: "Courier New";
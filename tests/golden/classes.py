@@ -0,0 +1,10 @@
+class Shape:
+    def area(self):
+        return 0
+
+class Square(Shape):
+    def area(self, side):
+        return side ** 2
+
+    def describe(self):
+        print(self)
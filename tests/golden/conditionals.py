@@ -0,0 +1,17 @@
+# classify a point
+def classify(x, y):
+    if x > 0:
+        if y > 0:
+            return 1
+        elif y < 0:
+            return 4
+        else:
+            return 0
+    elif 0 <= y < 10 and not x:
+        return 2
+    else:
+        return 3
+
+result = 7 // 2 + 7 % 3 - (1 + 2) * 3
+flags = 5 & 3 | 1 << 2
+print(result, flags)
@@ -0,0 +1,8 @@
+x = (1 + 2
+y = 3 $ 4
+if x
+    pass
+def f(:
+    return undefined_name
+s = 'unterminated
+z = [1, 2
@@ -0,0 +1,475 @@
+class Item0:
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 0
+        return factor
+
+def total0(items):
+    result = 0
+    for item in items:
+        if item > 0:
+            continue
+        result += item
+    return result
+
+values0 = [1, 2, 3]
+count0 = 0
+while count0 < 3:
+    count0 += 1
+print(values0, count0)
+class Item1(Item0):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 1
+        return factor
+
+def total1(items):
+    result = 0
+    for item in items:
+        if item > 1:
+            continue
+        result += item
+    return result
+
+values1 = [1, 2, 3]
+count1 = 0
+while count1 < 3:
+    count1 += 1
+print(values1, count1)
+class Item2(Item1):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 2
+        return factor
+
+def total2(items):
+    result = 0
+    for item in items:
+        if item > 2:
+            continue
+        result += item
+    return result
+
+values2 = [1, 2, 3]
+count2 = 0
+while count2 < 3:
+    count2 += 1
+print(values2, count2)
+class Item3(Item2):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 3
+        return factor
+
+def total3(items):
+    result = 0
+    for item in items:
+        if item > 3:
+            continue
+        result += item
+    return result
+
+values3 = [1, 2, 3]
+count3 = 0
+while count3 < 3:
+    count3 += 1
+print(values3, count3)
+class Item4(Item3):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 4
+        return factor
+
+def total4(items):
+    result = 0
+    for item in items:
+        if item > 4:
+            continue
+        result += item
+    return result
+
+values4 = [1, 2, 3]
+count4 = 0
+while count4 < 3:
+    count4 += 1
+print(values4, count4)
+class Item5(Item4):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 5
+        return factor
+
+def total5(items):
+    result = 0
+    for item in items:
+        if item > 5:
+            continue
+        result += item
+    return result
+
+values5 = [1, 2, 3]
+count5 = 0
+while count5 < 3:
+    count5 += 1
+print(values5, count5)
+class Item6(Item5):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 6
+        return factor
+
+def total6(items):
+    result = 0
+    for item in items:
+        if item > 6:
+            continue
+        result += item
+    return result
+
+values6 = [1, 2, 3]
+count6 = 0
+while count6 < 3:
+    count6 += 1
+print(values6, count6)
+class Item7(Item6):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 7
+        return factor
+
+def total7(items):
+    result = 0
+    for item in items:
+        if item > 7:
+            continue
+        result += item
+    return result
+
+values7 = [1, 2, 3]
+count7 = 0
+while count7 < 3:
+    count7 += 1
+print(values7, count7)
+class Item8(Item7):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 8
+        return factor
+
+def total8(items):
+    result = 0
+    for item in items:
+        if item > 8:
+            continue
+        result += item
+    return result
+
+values8 = [1, 2, 3]
+count8 = 0
+while count8 < 3:
+    count8 += 1
+print(values8, count8)
+class Item9(Item8):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 9
+        return factor
+
+def total9(items):
+    result = 0
+    for item in items:
+        if item > 9:
+            continue
+        result += item
+    return result
+
+values9 = [1, 2, 3]
+count9 = 0
+while count9 < 3:
+    count9 += 1
+print(values9, count9)
+class Item10(Item9):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 10
+        return factor
+
+def total10(items):
+    result = 0
+    for item in items:
+        if item > 10:
+            continue
+        result += item
+    return result
+
+values10 = [1, 2, 3]
+count10 = 0
+while count10 < 3:
+    count10 += 1
+print(values10, count10)
+class Item11(Item10):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 11
+        return factor
+
+def total11(items):
+    result = 0
+    for item in items:
+        if item > 11:
+            continue
+        result += item
+    return result
+
+values11 = [1, 2, 3]
+count11 = 0
+while count11 < 3:
+    count11 += 1
+print(values11, count11)
+class Item12(Item11):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 12
+        return factor
+
+def total12(items):
+    result = 0
+    for item in items:
+        if item > 12:
+            continue
+        result += item
+    return result
+
+values12 = [1, 2, 3]
+count12 = 0
+while count12 < 3:
+    count12 += 1
+print(values12, count12)
+class Item13(Item12):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 13
+        return factor
+
+def total13(items):
+    result = 0
+    for item in items:
+        if item > 13:
+            continue
+        result += item
+    return result
+
+values13 = [1, 2, 3]
+count13 = 0
+while count13 < 3:
+    count13 += 1
+print(values13, count13)
+class Item14(Item13):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 14
+        return factor
+
+def total14(items):
+    result = 0
+    for item in items:
+        if item > 14:
+            continue
+        result += item
+    return result
+
+values14 = [1, 2, 3]
+count14 = 0
+while count14 < 3:
+    count14 += 1
+print(values14, count14)
+class Item15(Item14):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 15
+        return factor
+
+def total15(items):
+    result = 0
+    for item in items:
+        if item > 15:
+            continue
+        result += item
+    return result
+
+values15 = [1, 2, 3]
+count15 = 0
+while count15 < 3:
+    count15 += 1
+print(values15, count15)
+class Item16(Item15):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 16
+        return factor
+
+def total16(items):
+    result = 0
+    for item in items:
+        if item > 16:
+            continue
+        result += item
+    return result
+
+values16 = [1, 2, 3]
+count16 = 0
+while count16 < 3:
+    count16 += 1
+print(values16, count16)
+class Item17(Item16):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 17
+        return factor
+
+def total17(items):
+    result = 0
+    for item in items:
+        if item > 17:
+            continue
+        result += item
+    return result
+
+values17 = [1, 2, 3]
+count17 = 0
+while count17 < 3:
+    count17 += 1
+print(values17, count17)
+class Item18(Item17):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 18
+        return factor
+
+def total18(items):
+    result = 0
+    for item in items:
+        if item > 18:
+            continue
+        result += item
+    return result
+
+values18 = [1, 2, 3]
+count18 = 0
+while count18 < 3:
+    count18 += 1
+print(values18, count18)
+class Item19(Item18):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 19
+        return factor
+
+def total19(items):
+    result = 0
+    for item in items:
+        if item > 19:
+            continue
+        result += item
+    return result
+
+values19 = [1, 2, 3]
+count19 = 0
+while count19 < 3:
+    count19 += 1
+print(values19, count19)
+class Item20(Item19):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 20
+        return factor
+
+def total20(items):
+    result = 0
+    for item in items:
+        if item > 20:
+            continue
+        result += item
+    return result
+
+values20 = [1, 2, 3]
+count20 = 0
+while count20 < 3:
+    count20 += 1
+print(values20, count20)
+class Item21(Item20):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 21
+        return factor
+
+def total21(items):
+    result = 0
+    for item in items:
+        if item > 21:
+            continue
+        result += item
+    return result
+
+values21 = [1, 2, 3]
+count21 = 0
+while count21 < 3:
+    count21 += 1
+print(values21, count21)
+class Item22(Item21):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 22
+        return factor
+
+def total22(items):
+    result = 0
+    for item in items:
+        if item > 22:
+            continue
+        result += item
+    return result
+
+values22 = [1, 2, 3]
+count22 = 0
+while count22 < 3:
+    count22 += 1
+print(values22, count22)
+class Item23(Item22):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 23
+        return factor
+
+def total23(items):
+    result = 0
+    for item in items:
+        if item > 23:
+            continue
+        result += item
+    return result
+
+values23 = [1, 2, 3]
+count23 = 0
+while count23 < 3:
+    count23 += 1
+print(values23, count23)
+class Item24(Item23):
+    def scaled(self, factor):
+        if factor > 1:
+            return factor * 24
+        return factor
+
+def total24(items):
+    result = 0
+    for item in items:
+        if item > 24:
+            continue
+        result += item
+    return result
+
+values24 = [1, 2, 3]
+count24 = 0
+while count24 < 3:
+    count24 += 1
+print(values24, count24)
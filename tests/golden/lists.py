@@ -0,0 +1,7 @@
+numbers = [1, 2, 3, 4, 5]
+names = ['a', "b", 'c']
+nested = [1, True, None, [6, 7]]
+empty = []
+ratio = 5 / 2
+pairs = {'one': 1, 'two': 2}
+print(numbers, names, nested, empty, ratio, pairs)
@@ -0,0 +1,12 @@
+total = 0
+count = 10
+while count > 0:
+    count -= 1
+    if count == 3:
+        break
+    if count % 2 == 0:
+        continue
+    total += count
+for item in [1, 2, 3]:
+    total = total + item * 2
+print(total)
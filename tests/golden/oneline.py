@@ -0,0 +1,11 @@
+x = [1, 2]
+
+def g(): return 1; y = 2
+
+class C: return; q = 1
+
+for i in x: continue; k = 1
+
+while x: break; w = 3
+
+if x: return; z = 4
@@ -0,0 +1,10 @@
+def greet(name):
+    message = "Hello, " + name
+    return message
+
+text = '''one
+two
+three'''
+doc = """first line
+second line"""
+print(text, doc)